@@ -0,0 +1,58 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <chrono>
+
+using namespace std;
+
+// inserting many tiny formulas one at a time and all at once
+
+static size_t
+heap_used()
+{
+  return mallinfo2().uordblks;
+}
+
+int
+main(int argc, char **argv)
+{
+  parse_trace = false;
+  const int n = argc > 1 ? atoi(argv[1]) : 2000;
+  vector<string> sources;
+  for(int i = 0; i < n; ++i) {
+    string name = "f" + to_string(i);
+    sources.push_back("int " + name + "(int x)\n{\n  return x * " + to_string(i) + " + x;\n}\n");
+  }
+
+  double seconds[2];
+  size_t bytes[2];
+  for(int bulk = 0; bulk < 2; ++bulk) {
+    size_t before = heap_used();
+    auto start = chrono::steady_clock::now();
+    Runtime *rt = new Runtime;
+    if (bulk) {
+      rt->insert(sources);
+    } else {
+      for(auto &source: sources) {
+        auto in = fmemopen((void*)source.data(), source.size(), "r");
+        rt->insert(parse(in));
+        fclose(in);
+      }
+    }
+    seconds[bulk] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    bytes[bulk] = heap_used() - before;
+    if (rt->call("f7", 3)->value.i != 24) {
+      fprintf(stderr, "wrong result\n");
+      return EXIT_FAILURE;
+    }
+    delete rt;
+  }
+  for(int bulk = 0; bulk < 2; ++bulk) {
+    printf("%-14s %6d formulas %10.1f us/formula %8zu bytes/formula\n", bulk ? "bulk" : "one at a time",
+           n, seconds[bulk] * 1e6 / n, bytes[bulk] / n);
+  }
+  printf("%-14s %37.1fx %20.1fx\n", "ratio", seconds[0] / seconds[1], (double)bytes[0] / bytes[1]);
+  return EXIT_SUCCESS;
+}
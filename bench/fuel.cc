@@ -0,0 +1,53 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+using namespace std;
+
+// cost of metering fuel and of preempting and resuming a call
+
+static const char *source = R"(int fib(int n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+)";
+
+int
+main(int argc, char **argv)
+{
+  auto in = fmemopen((void*)source, strlen(source), "r");
+  auto root = parse(in);
+  fclose(in);
+
+  Runtime rt;
+  rt.insert(root);
+
+  const int n = 24;
+  rt.call("fib", n); // warm up
+  auto start = chrono::steady_clock::now();
+  rt.call("fib", n);
+  double plain = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%-26s %12.1f ms\n", "call", plain * 1000.0);
+
+  node_t *arg = node_new_value(n);
+  for(long slice: { LONG_MAX, 100000L, 1000L, 100L }) {
+    auto call = rt.prepare("fib", { arg });
+    unsigned runs = 1;
+    start = chrono::steady_clock::now();
+    while(!call->run(slice))
+      ++runs;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char name[64];
+    if (slice == LONG_MAX)
+      snprintf(name, sizeof(name), "prepare, unlimited");
+    else
+      snprintf(name, sizeof(name), "prepare, slices of %li", slice);
+    printf("%-26s %12.1f ms %+7.1f%% %8u runs\n", name, seconds * 1000.0, (seconds / plain - 1.0) * 100.0, runs);
+  }
+  node_free(arg);
+  return EXIT_SUCCESS;
+}
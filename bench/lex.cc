@@ -0,0 +1,82 @@
+#include "lex.hh"
+#include "scan.hh"
+#include "tokens.hh"
+#include "threadpool.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// lexer throughput on comment heavy source with each scanner, and of
+// lexing it in parallel
+
+static string
+corpus(size_t size)
+{
+  static const char *text =
+    "Generated by the model compiler. The comments are longer than the code\n"
+    "they describe, as in sources produced by tools that document each step\n"
+    "and carry a license header.\n";
+  string source;
+  for(unsigned i=0; source.size() < size; ++i) {
+    source += "/*\n";
+    for(int line=0; line<4; ++line)
+      source += text;
+    source += "*/\n";
+    source += "int generated_function_" + to_string(i) + "(int first_argument, int second_argument)\n{\n";
+    for(int line=0; line<4; ++line)
+      source += "  // the result does not depend on anything but the arguments passed\n";
+    source += "  println(\"generated function " + to_string(i) + " called with an argument of\", first_argument);\n";
+    source += "  return first_argument * 2 + second_argument;\n}\n\n";
+  }
+  return source;
+}
+
+int
+main(int argc, char **argv)
+{
+  string source = corpus(argc > 1 ? atol(argv[1]) << 20 : 32 << 20);
+  scan_level_e best = scan_select(SCAN_AVX2);
+  for(int level=SCAN_SCALAR; level<=best; ++level) {
+    scan_select((scan_level_e)level);
+    auto in = fmemopen((void*)source.data(), source.size(), "r");
+    lex_open(in);
+    size_t count = 0;
+    auto start = chrono::steady_clock::now();
+    while(node_t *n = lex()) {
+      lexfree(n);
+      ++count;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    lex_open(nullptr);
+    fclose(in);
+    printf("%-8s %10zu tokens %10.1f MB/s\n", scan_name((scan_level_e)level), count,
+           source.size() / seconds / (1 << 20));
+  }
+
+  const char *begin = source.data(), *end = begin + source.size();
+  auto start = chrono::steady_clock::now();
+  auto tokens = lex_all(begin, end);
+  double sequential = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%-8s %10zu tokens %10.1f MB/s\n", "memory", tokens.size(), source.size() / sequential / (1 << 20));
+  for(auto n: tokens)
+    lexfree(n);
+
+  unsigned cores = thread::hardware_concurrency();
+  for(unsigned threads=2; threads<=max(cores, 2u); threads*=2) {
+    ThreadPool pool(threads - 1);
+    start = chrono::steady_clock::now();
+    tokens = lex_parallel(begin, end, pool);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char name[32];
+    snprintf(name, sizeof(name), "%u threads", threads);
+    printf("%-8s %10zu tokens %10.1f MB/s %6.2fx\n", name, tokens.size(), source.size() / seconds / (1 << 20), sequential / seconds);
+    for(auto n: tokens)
+      lexfree(n);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// scaling of parallel_for from one thread up to one thread per core
+
+static const char *source = R"(int fib(int n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+int work(int i)
+{
+  return fib(16 + i % 2);
+}
+int main(int n)
+{
+  parallel_for(0, n, work);
+  return 0;
+}
+)";
+
+int
+main(int argc, char **argv)
+{
+  auto in = fmemopen((void*)source, strlen(source), "r");
+  auto root = parse(in);
+  fclose(in);
+
+  Runtime rt;
+  rt.insert(root);
+
+  unsigned cores = thread::hardware_concurrency();
+  double single = 0.0;
+  printf("%8s %12s %8s\n", "threads", "time [ms]", "speedup");
+  for(unsigned threads=1; ; threads*=2) {
+    if (threads > cores)
+      threads = cores;
+    rt.threads(threads);
+    auto start = chrono::steady_clock::now();
+    rt.call("main", 256);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (threads == 1)
+      single = seconds;
+    printf("%8u %12.1f %8.2f\n", threads, seconds * 1000.0, single / seconds);
+    if (threads == cores)
+      break;
+  }
+  return EXIT_SUCCESS;
+}
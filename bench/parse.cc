@@ -0,0 +1,45 @@
+#include "lex.hh"
+#include "threadpool.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// parsing a source with thousands of functions in sequence and in parallel
+
+int
+main(int argc, char **argv)
+{
+  unsigned functions = argc > 1 ? atoi(argv[1]) : 20000;
+  string source;
+  for(unsigned i=0; i<functions; ++i) {
+    source += "int f" + to_string(i) + "(int a, int b)\n{\n";
+    source += "  if (a < " + to_string(i) + ") {\n    return a * (b + 1) - f0(b, a);\n  }\n";
+    source += "  return f" + to_string(i) + "(a - 1, b + a / 2);\n}\n";
+  }
+  const char *begin = source.data(), *end = begin + source.size();
+  parse_trace = false;
+
+  auto start = chrono::steady_clock::now();
+  node_t *root = parse(begin, end);
+  double sequential = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%-12s %10.1f ms\n", "sequential", sequential * 1000.0);
+  node_free(root);
+
+  unsigned cores = thread::hardware_concurrency();
+  for(unsigned threads=1; threads<=max(cores, 2u); threads*=2) {
+    ThreadPool pool(threads - 1);
+    start = chrono::steady_clock::now();
+    root = parse_parallel(begin, end, pool);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char name[32];
+    snprintf(name, sizeof(name), "%u threads", threads);
+    printf("%-12s %10.1f ms %6.2fx\n", name, seconds * 1000.0, sequential / seconds);
+    node_free(root);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+#include "actor.hh"
+
+#include <stdlib.h>
+#include <map>
+#include <stdexcept>
+
+using namespace std;
+
+// actors by name, for scripts posting to each other
+static mutex registry_lock;
+static map<string, Actor*> registry;
+
+Actor::Actor(const string &name, shared_ptr<const Program> program, size_t capacity):
+  name(name), context(program), head(0), tail(0), stop(false), sleeping(false)
+{
+  size_t size = 1;
+  while(size < capacity)
+    size *= 2;
+  cells.reset(new cell_t[size]);
+  mask = size - 1;
+  for(size_t i=0; i<size; ++i) {
+    cells[i].sequence = i;
+    cells[i].request = nullptr;
+  }
+  {
+    lock_guard<mutex> guard(registry_lock);
+    if (registry.find(name) != registry.end())
+      throw invalid_argument("actor '" + name + "' already exists");
+    registry[name] = this;
+  }
+  thread = std::thread(&Actor::run, this);
+}
+
+Actor::~Actor()
+{
+  {
+    lock_guard<mutex> guard(registry_lock);
+    registry.erase(name);
+  }
+  {
+    lock_guard<mutex> guard(idle_lock);
+    stop = true;
+  }
+  idle.notify_one();
+  thread.join();
+}
+
+Actor*
+Actor::find(const string &name)
+{
+  lock_guard<mutex> guard(registry_lock);
+  auto actor = registry.find(name);
+  return actor == registry.end() ? nullptr : actor->second;
+}
+
+Actor::request_t*
+Actor::request(const string &function, const vector<node_t*> &args, bool reply)
+{
+  request_t *r = new request_t;
+  r->function = function;
+  for(auto arg: args)
+    r->args.push_back(node_copy(arg));
+  r->reply = reply;
+  return r;
+}
+
+// a cell can be written when its sequence equals the position and read
+// when it equals position + 1
+bool
+Actor::push(request_t *r)
+{
+  size_t position = head.load(memory_order_relaxed);
+  while(true) {
+    cell_t &cell = cells[position & mask];
+    intptr_t difference = (intptr_t)(cell.sequence.load(memory_order_acquire) - position);
+    if (difference == 0) {
+      if (head.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+        break;
+    }
+    else if (difference < 0) {
+      return false; // full
+    }
+    else {
+      position = head.load(memory_order_relaxed);
+    }
+  }
+  cell_t &cell = cells[position & mask];
+  cell.request = r;
+  cell.sequence.store(position + 1, memory_order_release);
+
+  // the actor announces going to sleep before checking the queue a last
+  // time; the fences keep either side from missing the other's store
+  atomic_thread_fence(memory_order_seq_cst);
+  if (sleeping.load()) {
+    lock_guard<mutex> guard(idle_lock);
+    idle.notify_one();
+  }
+  return true;
+}
+
+Actor::request_t*
+Actor::pop()
+{
+  cell_t &cell = cells[tail & mask];
+  if (cell.sequence.load(memory_order_acquire) != tail + 1)
+    return nullptr;
+  request_t *r = cell.request;
+  cell.sequence.store(tail + mask + 1, memory_order_release);
+  ++tail;
+  return r;
+}
+
+future<node_t*>
+Actor::post(const string &function, const vector<node_t*> &args)
+{
+  request_t *r = request(function, args, true);
+  auto result = r->result.get_future();
+  while(!push(r))
+    this_thread::yield();
+  return result;
+}
+
+bool
+Actor::send(const string &function, const vector<node_t*> &args)
+{
+  request_t *r = request(function, args, false);
+  if (push(r))
+    return true;
+  for(auto arg: r->args)
+    node_free(arg);
+  delete r;
+  return false;
+}
+
+void
+Actor::run()
+{
+  while(true) {
+    request_t *r = pop();
+    if (!r) {
+      unique_lock<mutex> guard(idle_lock);
+      sleeping = true;
+      atomic_thread_fence(memory_order_seq_cst);
+      r = pop();
+      if (!r) {
+        if (stop)
+          return;
+        idle.wait(guard);
+        sleeping = false;
+        continue;
+      }
+      sleeping = false;
+    }
+    node_t *result = nullptr;
+    exception_ptr failure;
+    try {
+      result = context.invoke(r->function.c_str(), r->args);
+    }
+    catch(...) {
+      // the request failed, not the actor
+      failure = current_exception();
+    }
+    for(auto arg: r->args)
+      node_free(arg);
+    if (!r->reply)
+      node_free(result);
+    else if (failure)
+      r->result.set_exception(failure);
+    else
+      r->result.set_value(result);
+    delete r;
+  }
+}
+
+// post(actor, function, args...) sends function(args...) to the actor
+// named by the string 'actor' without waiting for it; returns false when
+// its mailbox is full
+node_t*
+ExecutionContext::post(node_t *args, frame_t &frame)
+{
+  node_t *name = args ? eval(args, frame) : nullptr;
+  if (!name || name->tkn != TKN_STRING || !args->next || args->next->tkn != TKN_IDENTIFIER)
+    throw script_error("post(actor, function, args...) expected");
+  string actor_name = name->text;
+  // copies, evaluating the next argument may collect the previous one
+  vector<node_t*> values;
+  struct release {
+    vector<node_t*> &values;
+    ~release() {
+      for(auto value: values)
+        node_free(value);
+    }
+  } guard { values };
+  for(node_t *e = args->next->next; e; e=e->next) {
+    node_t *value = eval(e, frame);
+    values.push_back(value ? node_copy(value) : node_new(TKN_NONE));
+  }
+
+  bool sent = false;
+  {
+    // the actor can't go away while the registry is locked
+    lock_guard<mutex> guard(registry_lock);
+    auto actor = registry.find(actor_name);
+    if (actor == registry.end())
+      throw script_error("post: unknown actor '" + actor_name + "'");
+    sent = actor->second->send(args->next->text, values);
+  }
+  node_t *result = value(0);
+  result->tkn = sent ? TKN_TRUE : TKN_FALSE;
+  return result;
+}
@@ -0,0 +1,79 @@
+#ifndef ACTOR_HH_
+#define ACTOR_HH_
+
+#include "runtime.hh"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Executes a Program on a thread of its own. Other threads call script
+// functions by posting requests to its mailbox, a bounded lock-free
+// queue with many producers and the actor as the only consumer.
+// Arguments are copied into the request and results copied out of it, so
+// nothing of the interpreter is touched by more than one thread.
+class Actor {
+    struct request_t {
+      std::string function;
+      std::vector<node_t*> args;
+      bool reply; // false for messages posted by scripts
+      std::promise<node_t*> result;
+    };
+    struct cell_t {
+      std::atomic<size_t> sequence;
+      request_t *request;
+    };
+
+    std::string name;
+    ExecutionContext context;
+    std::unique_ptr<cell_t[]> cells;
+    size_t mask;
+    std::atomic<size_t> head; // next cell to write
+    size_t tail; // next cell to read, only used by the actor thread
+    std::atomic<bool> stop;
+    std::atomic<bool> sleeping;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::thread thread;
+
+  public:
+    // 'capacity' is rounded up to a power of two; throws
+    // std::invalid_argument when 'name' is taken
+    Actor(const std::string &name, std::shared_ptr<const Program> program, size_t capacity = 1024);
+    // executes the requests already posted before returning
+    ~Actor();
+
+    // the actor registered as 'name' or nullptr
+    static Actor* find(const std::string &name);
+
+    // call function(args...) on the actor's thread; the caller owns the
+    // result and the nodes in 'args' stay with the caller; an exception
+    // thrown by the call is thrown by the future instead
+    std::future<node_t*> post(const std::string &function, const std::vector<node_t*> &args);
+
+    template <typename... T>
+    std::future<node_t*> call(const std::string &function, T... t) {
+      std::vector<node_t*> args = { node_new_value(t)... };
+      auto result = post(function, args);
+      for(auto arg: args)
+        node_free(arg);
+      return result;
+    }
+
+    // like post, but without waiting for room in the mailbox and without
+    // a result; false if the mailbox is full
+    bool send(const std::string &function, const std::vector<node_t*> &args);
+
+  private:
+    request_t* request(const std::string &function, const std::vector<node_t*> &args, bool reply);
+    bool push(request_t *r);
+    request_t* pop();
+    void run();
+};
+
+#endif // #ifndef ACTOR_HH_
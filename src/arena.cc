@@ -0,0 +1,78 @@
+#include "arena.hh"
+#include "memory.hh"
+
+#include <stdlib.h>
+
+using namespace std;
+
+// nodes and texts are taken from blocks this big
+static const size_t BLOCK = 65536;
+
+thread_local NodeArena *node_arena = nullptr;
+
+size_t
+NodeArena::hash_t::operator()(const char *text) const
+{
+  size_t h = 0;
+  for(; *text; ++text)
+    h = h * 31 + (unsigned char)*text;
+  return h;
+}
+
+NodeArena::~NodeArena()
+{
+  for(auto block: blocks)
+    free(block);
+  memory_released(MEMORY_AST, size);
+}
+
+void*
+NodeArena::allocate(size_t bytes)
+{
+  bytes = (bytes + 7) & ~(size_t)7;
+  if ((size_t)(end - pos) < bytes) {
+    size_t capacity = max(BLOCK, bytes);
+    pos = (char*)malloc(capacity);
+    end = pos + capacity;
+    blocks.push_back(pos);
+    size += capacity;
+    memory_allocated(MEMORY_AST, capacity);
+  }
+  void *p = pos;
+  pos += bytes;
+  return p;
+}
+
+node_t*
+NodeArena::node()
+{
+  if (!spare)
+    return (node_t*)allocate(sizeof(node_t));
+  node_t *n = spare;
+  spare = n->next;
+  return n;
+}
+
+const char*
+NodeArena::intern(const char *text)
+{
+  auto found = unique.find(text);
+  if (found != unique.end())
+    return *found;
+  size_t length = strlen(text) + 1;
+  char *copy = (char*)allocate(length);
+  memcpy(copy, text, length);
+  unique.insert(copy);
+  return copy;
+}
+
+NodeArena::Use::Use(NodeArena *arena):
+  previous(node_arena)
+{
+  node_arena = arena;
+}
+
+NodeArena::Use::~Use()
+{
+  node_arena = previous;
+}
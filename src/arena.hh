@@ -0,0 +1,60 @@
+#ifndef ARENA_HH_
+#define ARENA_HH_
+
+#include "lex.hh"
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <unordered_set>
+
+// Memory for parse trees that are released together. While an arena is
+// used on a thread, node_new and node_set_text take their memory from it
+// and nodes disposed of are kept for reuse, so the trees built meanwhile
+// must not be freed; they go with the arena. Equal texts are stored once.
+class NodeArena {
+  public:
+    NodeArena() {}
+    ~NodeArena();
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    void* allocate(size_t bytes);
+    node_t* node();
+    void dispose(node_t *n) { n->next = spare; spare = n; }
+    // the arena's copy of 'text'
+    const char* intern(const char *text);
+    // bytes taken from the heap
+    size_t bytes() const { return size; }
+    size_t texts() const { return unique.size(); }
+
+    // node_new uses 'arena', or the heap when it is null, on this thread
+    // while a Use exists
+    class Use {
+      public:
+        Use(NodeArena *arena);
+        ~Use();
+        Use(const Use&) = delete;
+        Use& operator=(const Use&) = delete;
+      private:
+        NodeArena *previous;
+    };
+
+  private:
+    struct hash_t {
+      size_t operator()(const char *text) const;
+    };
+    struct equal_t {
+      bool operator()(const char *a, const char *b) const { return strcmp(a, b) == 0; }
+    };
+    std::vector<char*> blocks;
+    char *pos = nullptr, *end = nullptr;
+    node_t *spare = nullptr; // disposed of, linked by next
+    std::unordered_set<const char*, hash_t, equal_t> unique;
+    size_t size = 0;
+};
+
+// the arena in use on this thread, if any
+extern thread_local NodeArena *node_arena;
+
+#endif // #ifndef ARENA_HH_
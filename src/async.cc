@@ -0,0 +1,82 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+
+using namespace std;
+
+// A script call in flight. Completions keep it alive until it is done.
+struct ExecutionContext::invocation_t: enable_shared_from_this<invocation_t> {
+  enum { RUNNING, CALLING, COMPLETED, WAITING };
+
+  ExecutionContext context;
+  machine_t machine;
+  frame_t frame;
+  node_t *call;
+  node_t *args; // of the pending native, until it completes
+  function<void(node_t*)> done;
+  atomic<int> state;
+
+  invocation_t(const ExecutionContext &parent): context(parent), call(nullptr), args(nullptr), state(RUNNING) {}
+  ~invocation_t() { node_free(call); node_free(args); }
+  void resume();
+  void complete(node_t *result);
+};
+
+// run until finished or until an async native didn't complete right away
+void
+ExecutionContext::invocation_t::resume()
+{
+  while(true) {
+    state = RUNNING;
+    // the native has completed
+    node_free(args);
+    args = nullptr;
+    node_t *result = context.run(machine);
+    if (!machine.suspended) {
+      done(result);
+      return;
+    }
+    auto native = context.program->async_functions.find(machine.pending)->second;
+    args = machine.pending_args;
+    machine.pending_args = nullptr;
+
+    state = CALLING;
+    auto self = shared_from_this();
+    native(args ? args->down : nullptr, [self](node_t *result) {
+      self->complete(result);
+    });
+    // unless the native completed within the call, whoever completes it resumes
+    int expected = CALLING;
+    if (state.compare_exchange_strong(expected, WAITING))
+      return;
+  }
+}
+
+void
+ExecutionContext::invocation_t::complete(node_t *result)
+{
+  machine.values.push_back(result);
+  int expected = CALLING;
+  if (state.compare_exchange_strong(expected, COMPLETED))
+    return;
+  resume();
+}
+
+void
+ExecutionContext::call_async(const char *name, const vector<node_t*> &args, function<void(node_t*)> done)
+{
+  follow();
+  auto invocation = make_shared<invocation_t>(*this);
+  node_t *call = node_new(TKN_FUNCTION_CALL);
+  node_append(call, node_new_txt(TKN_IDENTIFIER, name));
+  node_t *list = node_new(TKN_EXPRESSION_LIST);
+  node_append(call, list);
+  for(auto arg: args)
+    node_append(list, node_copy(arg));
+  invocation->call = call;
+  invocation->done = done;
+  invocation->machine.async = true;
+  invocation->machine.frames.push_back(&invocation->frame);
+  invocation->context.push(invocation->machine, call);
+  invocation->resume();
+}
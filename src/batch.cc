@@ -0,0 +1,244 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <algorithm>
+
+using namespace std;
+
+// rows are evaluated in blocks small enough to keep the temporaries in cache
+static const size_t block = 1024;
+// nested calls recurse on the C stack, a few frames each
+static const size_t batch_calls = 500;
+
+// one operation over a whole block of rows, with the dispatch hoisted out
+// of loops simple enough for the compiler to vectorize
+static void
+kernel(int tkn, const int *a, const int *b, int *r, size_t n)
+{
+  switch(tkn) {
+    // wrap around instead of overflowing, as node_arith does
+    case '+':
+      for(size_t i=0; i<n; ++i) r[i] = (int)((unsigned)a[i] + (unsigned)b[i]);
+      break;
+    case '-':
+      for(size_t i=0; i<n; ++i) r[i] = (int)((unsigned)a[i] - (unsigned)b[i]);
+      break;
+    case '*':
+      for(size_t i=0; i<n; ++i) r[i] = (int)((unsigned)a[i] * (unsigned)b[i]);
+      break;
+    case '/':
+    case '%':
+      for(size_t i=0; i<n; ++i) {
+        if (b[i] == 0)
+          throw ExecutionContext::script_error("division by zero");
+        if (a[i] == INT_MIN && b[i] == -1)
+          throw ExecutionContext::script_error("division overflow");
+        r[i] = tkn == '/' ? a[i] / b[i] : a[i] % b[i];
+      }
+      break;
+    case TKN_SHL:
+    case TKN_SHR:
+      for(size_t i=0; i<n; ++i) {
+        if (b[i] < 0 || b[i] > 31)
+          throw ExecutionContext::script_error("shift count out of range");
+        r[i] = tkn == TKN_SHL ? (int)((unsigned)a[i] << b[i]) : a[i] >> b[i];
+      }
+      break;
+    case '<':
+      for(size_t i=0; i<n; ++i) r[i] = a[i] < b[i];
+      break;
+    case '>':
+      for(size_t i=0; i<n; ++i) r[i] = a[i] > b[i];
+      break;
+    case TKN_LE:
+      for(size_t i=0; i<n; ++i) r[i] = a[i] <= b[i];
+      break;
+    case TKN_GE:
+      for(size_t i=0; i<n; ++i) r[i] = a[i] >= b[i];
+      break;
+    case TKN_EQ:
+      for(size_t i=0; i<n; ++i) r[i] = a[i] == b[i];
+      break;
+    case TKN_NEQ:
+      for(size_t i=0; i<n; ++i) r[i] = a[i] != b[i];
+      break;
+    default:
+      assert(false);
+  }
+}
+
+void
+ExecutionContext::call_batch(const char *name, size_t rows, initializer_list<const int*> columns, int *out)
+{
+  follow();
+  auto fun = program->functions.find(name);
+  if (fun == program->functions.end())
+    throw script_error(string("unknown function '") + name + "'");
+  for(size_t offset=0; offset<rows; offset+=block) {
+    batch_frame_t frame;
+    auto column = columns.begin();
+    for(node_t *p = fun->second->down->next->down; p; p=p->next, ++column) {
+      if (column == columns.end())
+        throw script_error(string("missing column for parameter of '") + name + "'");
+      frame[p->down->next->text] = *column + offset;
+    }
+    call_batch(fun->second.get(), frame, min(block, rows-offset), out+offset, 1);
+  }
+}
+
+void
+ExecutionContext::call_batch(node_t *function, batch_frame_t &frame, size_t rows, int *out, size_t depth)
+{
+  if (depth > min(max_calls, batch_calls))
+    throw stack_overflow(string("calls nested too deep in '") + function->text + "'");
+  // every row enters the function
+  if ((fuel -= (long)rows) < 0) {
+    fuel += (long)rows;
+    throw out_of_fuel();
+  }
+  vector<size_t> active(rows);
+  for(size_t i=0; i<rows; ++i)
+    active[i] = i;
+  exec_batch(function->down->next->next, frame, active, out, depth);
+  if (!active.empty())
+    throw script_error(string("function '") + function->text + "' did not return a value");
+}
+
+// execute statement 'n' for 'rows' and remove the rows which returned
+void
+ExecutionContext::exec_batch(node_t *n, batch_frame_t &frame, vector<size_t> &rows, int *out, size_t depth)
+{
+  switch(n->tkn) {
+    case TKN_STATEMENT_SEQ:
+      for(node_t *p = n->down; p && !rows.empty(); p=p->next)
+        exec_batch(p, frame, rows, out, depth);
+      break;
+    case TKN_RETURN: {
+      auto values = eval_batch(n->down, frame, rows, depth);
+      for(size_t i=0; i<rows.size(); ++i)
+        out[rows[i]] = values[i];
+      rows.clear();
+    } break;
+    case TKN_IF: {
+      auto condition = eval_batch(n->down, frame, rows, depth);
+      vector<size_t> then, otherwise;
+      for(size_t i=0; i<rows.size(); ++i)
+        (condition[i] ? then : otherwise).push_back(rows[i]);
+      if (!then.empty())
+        exec_batch(n->down->next, frame, then, out, depth);
+      if (!otherwise.empty() && n->down->next->next)
+        exec_batch(n->down->next->next, frame, otherwise, out, depth);
+      rows.resize(then.size() + otherwise.size());
+      merge(then.begin(), then.end(), otherwise.begin(), otherwise.end(), rows.begin());
+    } break;
+    default:
+      eval_batch(n, frame, rows, depth);
+  }
+}
+
+// evaluate expression 'n' for 'rows'
+vector<int>
+ExecutionContext::eval_batch(node_t *n, batch_frame_t &frame, const vector<size_t> &rows, size_t depth)
+{
+  size_t size = rows.size();
+  vector<int> result(size);
+  switch(n->tkn) {
+    case TKN_VALUE_INT:
+      fill(result.begin(), result.end(), n->value.i);
+      break;
+    case TKN_TRUE:
+    case TKN_FALSE:
+      fill(result.begin(), result.end(), n->tkn == TKN_TRUE);
+      break;
+    case TKN_EXPRESSION:
+      for(node_t *p = n->down; p; p=p->next)
+        result = eval_batch(p, frame, rows, depth);
+      break;
+    case TKN_IDENTIFIER: {
+      auto column = frame.find(n->text);
+      if (column == frame.end())
+        throw script_error(string("unknown variable '") + n->text + "'");
+      const int *data = column->second;
+      for(size_t i=0; i<size; ++i)
+        result[i] = data[rows[i]];
+    } break;
+    case TKN_FUNCTION_CALL: {
+      const char *name = n->down->text;
+      vector<vector<int>> args;
+      for(node_t *e = n->down->next->down; e; e=e->next)
+        args.push_back(eval_batch(e, frame, rows, depth));
+
+      auto native_fun = program->native_functions.find(name);
+      if (native_fun != program->native_functions.end()) {
+        // natives only know about single values, the same arguments are
+        // filled in for every row
+        node_t *list = node_new(TKN_EXPRESSION_LIST);
+        for(size_t a=0; a<args.size(); ++a)
+          node_append(list, node_new_value(0));
+        struct release {
+          node_t *list;
+          ~release() { node_free(list); }
+        } guard { list };
+        for(size_t i=0; i<size; ++i) {
+          size_t a = 0;
+          for(node_t *p = list->down; p; p=p->next, ++a) {
+            p->tkn = TKN_VALUE_INT;
+            p->value.i = args[a][i];
+          }
+          node_t *value = native_fun->second(list->down);
+          bool argument = false;
+          for(node_t *p = list->down; p; p=p->next)
+            argument |= p == value;
+          bool returned = value && value->tkn == TKN_VALUE_INT;
+          if (returned)
+            result[i] = value->value.i;
+          // only its int is kept
+          if (value && !argument)
+            node_free(value);
+          if (!returned)
+            throw script_error(string("native '") + name + "' did not return an int");
+        }
+        break;
+      }
+
+      auto fun = program->functions.find(name);
+      if (fun == program->functions.end())
+        throw script_error(string("unknown function '") + name + "'");
+      batch_frame_t callee;
+      auto arg = args.begin();
+      for(node_t *p = fun->second->down->next->down; p && arg != args.end(); p=p->next, ++arg)
+        callee[p->down->next->text] = arg->data();
+      call_batch(fun->second.get(), callee, size, result.data(), depth + 1);
+    } break;
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case TKN_SHL:
+    case TKN_SHR:
+    case '<':
+    case '>':
+    case TKN_LE:
+    case TKN_GE:
+    case TKN_EQ:
+    case TKN_NEQ: {
+      auto a = eval_batch(n->down, frame, rows, depth);
+      if (!n->down->next) {
+        // unary '-' and '+'
+        for(size_t i=0; i<size; ++i) {
+          if (!node_unary(n->tkn, a[i], &result[i]))
+            throw script_error(string("no code to evaluate unary '") + (char)n->tkn + "'");
+        }
+        break;
+      }
+      auto b = eval_batch(n->down->next, frame, rows, depth);
+      kernel(n->tkn, a.data(), b.data(), result.data(), size);
+    } break;
+    default:
+      throw script_error("no code to evaluate token " + to_string(n->tkn));
+  }
+  return result;
+}
@@ -0,0 +1,168 @@
+#include "document.hh"
+
+#include <stdexcept>
+
+using namespace std;
+
+static node_t*
+tail(node_t *n)
+{
+  while(n->next)
+    n = n->next;
+  return n;
+}
+
+Document::Document(const string &text):
+  source(text)
+{
+  if (!update(0, 0, 0))
+    parse_whole();
+}
+
+Document::~Document()
+{
+  clear();
+}
+
+void
+Document::edit(size_t offset, size_t erase, const string &insert)
+{
+  if (offset > source.size() || erase > source.size() - offset)
+    throw out_of_range("Document::edit");
+  source.replace(offset, erase, insert);
+  if (whole) {
+    clear();
+    if (!update(0, 0, 0))
+      parse_whole();
+    return;
+  }
+  // text just after a ';' or '}' starts the next declaration
+  size_t first = 0;
+  while(first < declarations.size() && declarations[first].end <= offset)
+    ++first;
+  if (!update(first, offset + erase, (ptrdiff_t)insert.size() - (ptrdiff_t)erase)) {
+    clear();
+    parse_whole();
+  }
+}
+
+// Re-parses from the start of declarations[first]. An old declaration
+// ending at 'changed_end' or later is in text that didn't change, shifted
+// by 'delta'. False when the declarations can't be parsed one by one.
+bool
+Document::update(size_t first, size_t changed_end, ptrdiff_t delta)
+{
+  const char *begin = source.data(), *end = begin + source.size();
+  size_t start = first ? declarations[first - 1].end : 0;
+  vector<declaration_t> fresh;
+  vector<node_t*> tokens;
+  size_t reuse = declarations.size(), k = first;
+  int depth = 0;
+  bool ok = true;
+  try {
+    lex_open(begin + start, end);
+    while(node_t *token = lex()) {
+      tokens.push_back(token);
+      switch(token->tkn) {
+        case '{': case '(': ++depth; break;
+        case '}': case ')': --depth; break;
+      }
+      if (depth != 0 || (token->tkn != ';' && token->tkn != '}'))
+        continue;
+      size_t at = lex_position() - begin;
+      node_t *tree = parse_declaration(tokens.data(), tokens.data() + tokens.size());
+      tokens.clear();
+      if (!tree) {
+        ok = false;
+        break;
+      }
+      fresh.push_back({at, tree, tail(tree)});
+      while(k < declarations.size() && (declarations[k].end < changed_end || declarations[k].end + delta < at))
+        ++k;
+      if (k < declarations.size() && declarations[k].end + delta == at) {
+        reuse = k + 1;
+        break;
+      }
+      lex_open(begin + at, end);
+    }
+    if (ok && !tokens.empty()) {
+      // the tail of the source, not ended by ';' or '}'
+      node_t *tree = parse_declaration(tokens.data(), tokens.data() + tokens.size());
+      tokens.clear();
+      if (tree)
+        fresh.push_back({source.size(), tree, tail(tree)});
+      else
+        ok = false;
+    }
+  }
+  catch(syntax_error&) {
+    ok = false;
+  }
+  lex_open(end, end);
+  for(auto token: tokens)
+    lexfree(token);
+  if (!ok) {
+    for(auto &d: fresh)
+      node_free(d.tree);
+    return false;
+  }
+
+  for(size_t i=first; i<reuse; ++i) {
+    declarations[i].last->next = nullptr;
+    node_free(declarations[i].tree);
+  }
+  for(size_t i=reuse; i<declarations.size(); ++i)
+    declarations[i].end += delta;
+  declarations.erase(declarations.begin() + first, declarations.begin() + reuse);
+  declarations.insert(declarations.begin() + first, fresh.begin(), fresh.end());
+  parsed = fresh.size();
+  link();
+  return true;
+}
+
+void
+Document::parse_whole()
+{
+  whole = true;
+  seq = parse(source.data(), source.data() + source.size());
+  parsed = 0;
+  if (seq) {
+    for(node_t *n = seq->down; n; n = n->next)
+      ++parsed;
+  }
+}
+
+void
+Document::link()
+{
+  if (declarations.empty()) {
+    // the declarations it pointed to are gone
+    if (seq)
+      seq->down = nullptr;
+    node_free(seq);
+    seq = nullptr;
+    return;
+  }
+  if (!seq)
+    seq = node_new(TKN_DECLARATION_SEQ);
+  seq->down = declarations[0].tree;
+  for(size_t i=0; i+1<declarations.size(); ++i)
+    declarations[i].last->next = declarations[i + 1].tree;
+  declarations.back().last->next = nullptr;
+}
+
+void
+Document::clear()
+{
+  if (seq && !whole) {
+    for(auto &d: declarations) {
+      d.last->next = nullptr;
+      node_free(d.tree);
+    }
+    seq->down = nullptr;
+  }
+  node_free(seq);
+  seq = nullptr;
+  declarations.clear();
+  whole = false;
+}
@@ -0,0 +1,54 @@
+#ifndef DOCUMENT_HH_
+#define DOCUMENT_HH_
+
+#include "lex.hh"
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Source being edited, with its parse tree kept up to date. An edit
+// re-lexes from the start of the first top level declaration it touches
+// and re-parses declarations until one ends where an old one did, after
+// the edit; the declarations from there on are kept as they are. When
+// that can't give what parsing the whole source does, such as with a
+// here-document, the whole source is parsed.
+class Document {
+  public:
+    // throws syntax_error
+    explicit Document(const std::string &text);
+    ~Document();
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    // replaces 'erase' characters at 'offset' with 'insert'; throws
+    // syntax_error, leaving the new text with no tree
+    void edit(size_t offset, size_t erase, const std::string &insert);
+    const std::string& text() const { return source; }
+    // TKN_DECLARATION_SEQ, owned by the document until the next edit
+    node_t* root() const { return seq; }
+    // top level declarations the last edit parsed
+    size_t reparsed() const { return parsed; }
+
+  private:
+    struct declaration_t {
+      // just after its last token
+      size_t end;
+      // the declarations are linked through the last of its siblings
+      node_t *tree, *last;
+    };
+
+    bool update(size_t first, size_t changed_end, ptrdiff_t delta);
+    void parse_whole();
+    void link();
+    void clear();
+
+    std::string source;
+    std::vector<declaration_t> declarations;
+    node_t *seq = nullptr;
+    // seq is from parsing the whole source, declarations is empty
+    bool whole = false;
+    size_t parsed = 0;
+};
+
+#endif // #ifndef DOCUMENT_HH_
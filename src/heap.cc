@@ -0,0 +1,142 @@
+#include "heap.hh"
+#include "memory.hh"
+
+#include <stdlib.h>
+#include <chrono>
+
+using namespace std;
+
+// the tkn of nursery cells that were moved, 'next' holds the new address
+static const int FORWARDED = -1;
+// the tkn of old cells on the free list
+static const int FREE = -2;
+
+// chunks swept per collection while a major collection is in progress
+static const size_t SWEEP_STEP = 4;
+
+Heap::Heap(size_t nursery_cells):
+  nursery_cells(nursery_cells ? nursery_cells : 1)
+{
+  nursery = new node_t[this->nursery_cells];
+  memory_allocated(MEMORY_VALUES, this->nursery_cells * sizeof(node_t));
+}
+
+Heap::~Heap()
+{
+  memory_released(MEMORY_VALUES, bytes());
+  delete[] nursery;
+  for(auto chunk: chunks)
+    delete chunk;
+}
+
+Heap::chunk_t*
+Heap::old(node_t *n)
+{
+  auto chunk = chunk_at.upper_bound(n);
+  if (chunk == chunk_at.begin())
+    return nullptr;
+  --chunk;
+  return n < chunk->first + CHUNK ? chunk->second : nullptr;
+}
+
+node_t*
+Heap::promote(node_t *n)
+{
+  if (n->tkn == FORWARDED)
+    return n->next;
+  node_t *cell = keep(n);
+  n->tkn = FORWARDED;
+  n->next = cell;
+  return cell;
+}
+
+node_t*
+Heap::keep(node_t *n)
+{
+  if (!n)
+    return n;
+  if (!free_cells && sweep_next < sweep_end) {
+    // finish sweeping before growing
+    while(!free_cells && sweep_next < sweep_end)
+      sweep(sweep_next++);
+    if (sweep_next == sweep_end)
+      threshold = max<size_t>(4 * CHUNK, 2 * statistics.old_cells);
+  }
+  if (!free_cells) {
+    chunk_t *chunk = new chunk_t;
+    memory_allocated(MEMORY_VALUES, sizeof(chunk_t));
+    for(size_t i=0; i<CHUNK; ++i) {
+      chunk->cells[i].tkn = FREE;
+      chunk->cells[i].next = i + 1 < CHUNK ? &chunk->cells[i + 1] : nullptr;
+      chunk->marks[i] = false;
+    }
+    free_cells = chunk->cells;
+    chunks.push_back(chunk);
+    chunk_at[chunk->cells] = chunk;
+    statistics.old_capacity += CHUNK;
+  }
+  node_t *cell = free_cells;
+  free_cells = cell->next;
+  *cell = *n;
+  cell->next = cell->down = nullptr;
+  ++statistics.old_cells;
+  return cell;
+}
+
+void
+Heap::sweep(size_t index)
+{
+  chunk_t *chunk = chunks[index];
+  for(size_t i=0; i<CHUNK; ++i) {
+    node_t *cell = &chunk->cells[i];
+    if (cell->tkn == FREE || !chunk->marks[i]) {
+      if (cell->tkn != FREE)
+        --statistics.old_cells;
+      cell->tkn = FREE;
+      cell->next = free_cells;
+      free_cells = cell;
+    }
+    chunk->marks[i] = false;
+  }
+}
+
+void
+Heap::collect(const function<void(const visit_t&)> &roots)
+{
+  auto start = chrono::steady_clock::now();
+
+  // minor: move what the roots reach out of the nursery
+  roots([this](node_t *&slot) {
+    if (slot >= nursery && slot < nursery + nursery_cells)
+      slot = promote(slot);
+  });
+  top = 0;
+  ++statistics.minor;
+
+  if (sweep_next < sweep_end) {
+    for(size_t i=0; i<SWEEP_STEP && sweep_next < sweep_end; ++i)
+      sweep(sweep_next++);
+    // grow with what survived
+    if (sweep_next == sweep_end)
+      threshold = max<size_t>(4 * CHUNK, 2 * statistics.old_cells);
+  }
+  else if (statistics.old_cells > threshold) {
+    // major: mark now, sweep a few chunks per following collection
+    roots([this](node_t *&slot) {
+      chunk_t *chunk = old(slot);
+      if (chunk)
+        chunk->marks[slot - chunk->cells] = true;
+    });
+    // the free list is rebuilt by sweeping, so that no value is allocated
+    // in a chunk that is still to be swept
+    free_cells = nullptr;
+    sweep_next = 0;
+    sweep_end = chunks.size();
+    ++statistics.major;
+  }
+
+  double pause = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  statistics.last_pause = pause;
+  statistics.max_pause = max(statistics.max_pause, pause);
+  statistics.total_pause += pause;
+}
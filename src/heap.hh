@@ -0,0 +1,67 @@
+#ifndef HEAP_HH_
+#define HEAP_HH_
+
+#include "lex.hh"
+
+#include <map>
+#include <vector>
+#include <functional>
+
+// Values created while evaluating scripts. New ones are bump allocated in
+// the nursery; a minor collection moves the reachable ones into the old
+// generation, which a major collection marks and then sweeps a few chunks
+// per collection. Values are immutable and never point to other values,
+// so neither a write barrier nor tracing beyond the roots is needed.
+class Heap {
+  public:
+    struct stats_t {
+      unsigned minor = 0;
+      unsigned major = 0;
+      double last_pause = 0.0; // seconds
+      double max_pause = 0.0;
+      double total_pause = 0.0;
+      size_t old_cells = 0; // values in the old generation
+      size_t old_capacity = 0;
+    };
+    // the collector passes each root slot to 'visit', which may update it
+    typedef std::function<void(node_t *&slot)> visit_t;
+
+    Heap(size_t nursery_cells = 4096);
+    ~Heap();
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    // a cell in the nursery, nullptr when it is full
+    node_t* allocate() { return top < nursery_cells ? &nursery[top++] : nullptr; }
+    // forget everything in the nursery, nothing may refer to it anymore
+    void reset() { top = 0; }
+    // a copy of 'n' in the old generation, alive while a root refers to it
+    node_t* keep(node_t *n);
+    // 'roots' must call visit for every slot referring to a value
+    void collect(const std::function<void(const visit_t&)> &roots);
+    const stats_t& stats() const { return statistics; }
+    size_t bytes() const { return nursery_cells * sizeof(node_t) + chunks.size() * sizeof(chunk_t); }
+
+  private:
+    enum { CHUNK = 1024 };
+    struct chunk_t {
+      node_t cells[CHUNK];
+      bool marks[CHUNK];
+    };
+
+    node_t *nursery;
+    size_t nursery_cells;
+    size_t top = 0;
+    std::vector<chunk_t*> chunks;
+    std::map<node_t*, chunk_t*> chunk_at; // by address of the first cell
+    node_t *free_cells = nullptr;
+    size_t sweep_next = 0, sweep_end = 0; // chunks still to sweep
+    size_t threshold = 4 * CHUNK; // old cells that start a major collection
+    stats_t statistics;
+
+    chunk_t* old(node_t *n);
+    node_t* promote(node_t *n);
+    void sweep(size_t chunk);
+};
+
+#endif // #ifndef HEAP_HH_
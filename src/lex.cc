@@ -1,4 +1,7 @@
 #include "lex.hh"
+#include "arena.hh"
+#include "memory.hh"
+#include "scan.hh"
 
 #include <stdlib.h>
 #include <string.h>
@@ -60,7 +63,7 @@ static token_e
 keywordByName(const char *name)
 {
   for (keyword_t *p = keywords; p->keyword; ++p) {
-    if (strcmp(name, p->keyword)==0)
+    if (p->keyword[0]==name[0] && strcmp(name, p->keyword)==0)
       return p->tkn;
   }
   return TKN_NONE;
@@ -70,7 +73,7 @@ static const char*
 keywordByToken(token_e tkn)
 {
   if (tkn<=255) {
-    static char buffer[2];
+    static thread_local char buffer[2];
     buffer[0] = tkn;
     buffer[1] = 0;
     return buffer;
@@ -112,29 +115,181 @@ keywordByToken(token_e tkn)
 
 static inline const char* keywordByToken(int tkn) { return keywordByToken(static_cast<token_e>(tkn)); }
 
-FILE* lex_in = 0;
-static node_t* lexstack[10];
-static size_t lex_sp=0;
-static char* yytext=0;
-static size_t yytext_size, yytext_capacity=0;
+// each thread has a lexer of its own
+thread_local FILE* lex_in = 0;
+static thread_local node_t* lexstack[10];
+static thread_local size_t lex_sp=0;
+static thread_local char* yytext=0;
+static thread_local size_t yytext_size, yytext_capacity=0;
 
-static inline void yyput(int c) {
-  if (yytext_size+1>=yytext_capacity) {
+// lex_in is read in blocks so that runs of characters can be scanned at
+// once; sources in memory are scanned where they are
+static const size_t LEX_BUFFER = 65536;
+static thread_local char *lex_buffer = 0;
+static thread_local const char *lex_pos = 0, *lex_end = 0;
+// read lex_in a line at a time
+static thread_local bool lex_lines = false;
+// tokens lexed before, handed out instead of lexing
+static thread_local node_t **lex_token = 0, **lex_token_end = 0;
+
+// frees the buffers of a thread's lexer when the thread ends
+static thread_local struct lex_release_t {
+  ~lex_release_t() {
+    if (yytext)
+      memory_released(MEMORY_LEXER, yytext_capacity);
+    if (lex_buffer)
+      memory_released(MEMORY_LEXER, LEX_BUFFER);
+    free(yytext);
+    free(lex_buffer);
+  }
+} lex_release;
+
+static inline void yyreserve(size_t size) {
+  if (yytext_size+size>=yytext_capacity) {
+    (void)&lex_release;
+    size_t grown = yytext_capacity;
     if (yytext_capacity == 0)
       yytext_capacity = 128;
-    else
+    while(yytext_size+size>=yytext_capacity)
       yytext_capacity <<= 1;
+    memory_allocated(MEMORY_LEXER, yytext_capacity - grown);
     yytext = (char*)realloc(yytext, yytext_capacity);
   }
+}
+
+static inline void yyput(int c) {
+  yyreserve(1);
   yytext[yytext_size] = c;
   yytext[++yytext_size] = 0;
 }
 
+static inline void yyappend(const char *text, size_t size) {
+  yyreserve(size);
+  memcpy(yytext + yytext_size, text, size);
+  yytext_size += size;
+  yytext[yytext_size] = 0;
+}
+
+void
+lex_open(FILE *in, bool lines)
+{
+  lex_in = in;
+  lex_lines = lines;
+  lex_pos = lex_end = lex_buffer;
+  lex_token = lex_token_end = 0;
+  lex_sp = 0;
+}
+
+void
+lex_open(const char *begin, const char *end)
+{
+  lex_in = 0;
+  lex_pos = begin;
+  lex_end = end;
+  lex_token = lex_token_end = 0;
+  lex_sp = 0;
+}
+
+void
+lex_open(node_t **begin, node_t **end)
+{
+  lex_in = 0;
+  lex_pos = lex_end = 0;
+  lex_token = begin;
+  lex_token_end = end;
+  lex_sp = 0;
+}
+
+const char*
+lex_position()
+{
+  return lex_pos;
+}
+
+// reads no further than the end of a line, which a pipe has as soon as
+// the line was written, where fread would wait for a full buffer
+static size_t
+lex_read_line(char *buffer, size_t size)
+{
+  size_t n = 0;
+  while(n < size) {
+    int c = getc_unlocked(lex_in);
+    if (c == EOF)
+      break;
+    buffer[n++] = c;
+    if (c == '\n')
+      break;
+  }
+  return n;
+}
+
+int
+lex_getc()
+{
+  if (lex_pos == lex_end) {
+    if (!lex_in)
+      return EOF;
+    if (!lex_buffer) {
+      (void)&lex_release;
+      memory_allocated(MEMORY_LEXER, LEX_BUFFER);
+      lex_buffer = (char*)malloc(LEX_BUFFER);
+    }
+    size_t size = lex_lines ? lex_read_line(lex_buffer, LEX_BUFFER) : fread(lex_buffer, 1, LEX_BUFFER, lex_in);
+    lex_pos = lex_buffer;
+    lex_end = lex_buffer + size;
+    if (size == 0)
+      return EOF;
+  }
+  return (unsigned char)*lex_pos++;
+}
+
+// only the character just read can be put back
+static inline void
+lex_ungetc(int c)
+{
+  if (c != EOF)
+    --lex_pos;
+}
+
+// consume what is buffered of a run of characters that doesn't change
+// 'state', the character ending it is handled as usual
+static inline void
+lex_skip(unsigned state)
+{
+  size_t size;
+  switch(state) {
+    case 0: // space, mostly single ones between tokens
+      if (lex_pos < lex_end && lex_pos[0] == ' ' && lex_pos + 1 < lex_end && lex_pos[1] != ' ')
+        ++lex_pos;
+      else
+        lex_pos += scanner.spaces(lex_pos, lex_end);
+      break;
+    case 12: // string
+      size = scanner.until(lex_pos, lex_end, '"', '\\');
+      yyappend(lex_pos, size);
+      lex_pos += size;
+      break;
+    case 14: // identifier
+      size = scanner.identifier(lex_pos, lex_end);
+      yyappend(lex_pos, size);
+      lex_pos += size;
+      break;
+    case 40: // /*...
+      lex_pos += scanner.until(lex_pos, lex_end, '*', '*');
+      break;
+    case 42: // //...
+      lex_pos += scanner.until(lex_pos, lex_end, '\n', '\n');
+      break;
+  }
+}
+
 node_t*
 lex0()
 {
   if (lex_sp > 0)
     return lexstack[--lex_sp];
+  if (lex_token)
+    return lex_token < lex_token_end ? *lex_token++ : 0;
 
   yytext_size = 0;
   if (yytext)
@@ -143,7 +298,8 @@ lex0()
   unsigned state = 0;
   bool loop = true;
   do {
-    int c = getc(lex_in);
+    lex_skip(state);
+    int c = lex_getc();
 //printf("lex: %c (%i) [%u]\n", c>=32?c:'.', c, state);
     if (c==EOF)
       loop = false;
@@ -185,8 +341,9 @@ lex0()
               yyput(c);
             } else
             if (!isspace(c)) {
-              fprintf(stderr, "error: unexpected '%c' (%i)\n", c, c);
-              exit(EXIT_FAILURE);
+              char message[64];
+              snprintf(message, sizeof(message), "error: unexpected '%c' (%i)", c, c);
+              throw syntax_error(message);
             }
         }
         break;
@@ -195,7 +352,7 @@ lex0()
           case '+': return node_new(TKN_INC);
           case '=': return node_new(TKN_APLUS);
         }
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('+');
       case 17: // -
         switch(c) {
@@ -203,55 +360,55 @@ lex0()
           case '=': return node_new(TKN_AMINUS);
           case '>': return node_new(TKN_PTR);
         }
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('-');
       case 18: // =
         if (c=='=')
           return node_new(TKN_EQ);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('=');
       case 19: // :
         if (c==':')
           return node_new(TKN_COL_COL);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new(':');
       case 20: // <
         switch(c) {
           case '<': state=30; break;
           case '=': return node_new(TKN_LE);
           default:
-            ungetc(c, lex_in);
+            lex_ungetc(c);
             return node_new('<');
         }
         break;
       case 30: // <<
         if (c=='=')
           return node_new(TKN_ASHL);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new(TKN_SHL);
       case 21: // >
         switch(c) {
           case '>': state=31; break;
           case '=': return node_new(TKN_GE);
           default:
-            ungetc(c, lex_in);
+            lex_ungetc(c);
             return node_new('>');
         }
         break;
       case 31:
         if (c=='=')
           return node_new(TKN_ASHR);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new(TKN_SHR);
       case 22: // !
         if (c=='=')
           return node_new(TKN_NEQ);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('!');
       case 23: // *
         if (c=='=')
           return node_new(TKN_AMULT);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('*');
       case 24: // /
         if (c=='=')
@@ -264,7 +421,7 @@ lex0()
           state = 42;
           break;
         }
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('/');
         
       case 40: // /*...
@@ -285,36 +442,39 @@ lex0()
       case 25: // %
         if (c=='=')
           return node_new(TKN_AMOD);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('%');
       case 26: // ^
         if (c=='=')
           return node_new(TKN_AXOR);
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('^');
       case 27: // .
         if (c=='.')
           state = 28;
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('.');
       case 28: // ..
         if (c=='.')
           return node_new(TKN_ELLIPSIS);
-        fprintf(stderr, "error: unexpected '..%c' (%i)\n", c, c);
-        exit(EXIT_FAILURE);        
+        {
+          char message[64];
+          snprintf(message, sizeof(message), "error: unexpected '..%c' (%i)", c, c);
+          throw syntax_error(message);
+        }
       case 10: // |
         switch(c) {
           case '|': return node_new(TKN_OR);
           case '=': return node_new(TKN_AOR);
         }
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('|');
       case 11: // &
         switch(c) {
           case '&': return node_new(TKN_AND);
           case '=': return node_new(TKN_AAND);
         }
-        ungetc(c, lex_in);
+        lex_ungetc(c);
         return node_new('&');
       case 12: // string
         switch(c) {
@@ -336,7 +496,7 @@ lex0()
         if (isalnum(c) || c=='_') {
           yyput(c);
         } else {
-          ungetc(c, lex_in);
+          lex_ungetc(c);
           token_e tkn = keywordByName(yytext);
           if (tkn!=TKN_NONE)
             return node_new(tkn);
@@ -353,15 +513,14 @@ lex0()
         if (isdigit(c)) {
           yyput(c);
         } else {
-          ungetc(c, lex_in);
+          lex_ungetc(c);
 	  return node_new_int(yytext);
         }
         break;  
     }
   } while(loop);
   if (state==12 || state==13) {
-    fprintf(stderr, "unexpected EOF in string\n");
-    exit(EXIT_FAILURE);
+    throw syntax_error("unexpected EOF in string");
   }
   if (state==14) {
     return node_new_txt(TKN_IDENTIFIER, yytext);
@@ -386,8 +545,7 @@ lexfree(node_t *n)
 {
   if (!n)
     return;
-  if (n->text)
-    free(n->text);
+  node_set_text(n, NULL);
   if (n->down) {
     fprintf(stderr, "ERROR: lexfree for node containing child\n");
     exit(EXIT_FAILURE);
@@ -396,7 +554,20 @@ lexfree(node_t *n)
     fprintf(stderr, "ERROR: lexfree for node containing sibling\n");
     exit(EXIT_FAILURE);
   }
-  free(n);
+  node_dispose(n);
+}
+
+void
+node_free(node_t *n)
+{
+  while(n) {
+    node_t *next = n->next;
+    if (n->down)
+      node_free(n->down);
+    node_set_text(n, NULL);
+    node_dispose(n);
+    n = next;
+  }
 }
 
 void
@@ -423,10 +594,43 @@ unlex(node_t *n)
   lexstack[lex_sp++] = n;
 }
 
+void
+node_dispose(node_t *n)
+{
+  if (node_arena) {
+    node_arena->dispose(n);
+    return;
+  }
+  memory_released(MEMORY_AST, sizeof(node_t));
+  free(n);
+}
+
+void
+node_set_text(node_t *n, const char *text)
+{
+  if (node_arena) {
+    n->text = text ? (char*)node_arena->intern(text) : NULL;
+    return;
+  }
+  if (n->text) {
+    memory_released(MEMORY_AST, strlen(n->text) + 1);
+    free(n->text);
+  }
+  n->text = text ? strdup(text) : NULL;
+  if (text)
+    memory_allocated(MEMORY_AST, strlen(text) + 1);
+}
+
 node_t*
 node_new(token_e tkn)
 {
-  node_t *o = (node_t*)malloc(sizeof(node_t));
+  node_t *o;
+  if (node_arena) {
+    o = node_arena->node();
+  } else {
+    memory_allocated(MEMORY_AST, sizeof(node_t));
+    o = (node_t*)malloc(sizeof(node_t));
+  }
   o->tkn = tkn;
   o->text = NULL;
   o->next = o->down = NULL;
@@ -436,10 +640,8 @@ node_new(token_e tkn)
 node_t*
 node_new_txt(token_e tkn, const char *txt)
 {
-  node_t *o = (node_t*)malloc(sizeof(node_t));
-  o->tkn = tkn;
-  o->text = strdup(txt);
-  o->next = o->down = NULL;
+  node_t *o = node_new(tkn);
+  node_set_text(o, txt);
   return o;
 }
 
@@ -472,6 +674,41 @@ node_new_value(double value) {
 }
 
 
+// deep copy of 'n' and its children, but not of its siblings
+node_t*
+node_copy(node_t *n)
+{
+  node_t *o = node_new(TKN_NONE);
+  *o = *n;
+  o->text = NULL;
+  node_set_text(o, n->text);
+  o->next = o->down = NULL;
+  for(node_t *p = n->down; p; p=p->next)
+    node_append(o, node_copy(p));
+  return o;
+}
+
+// true when 'a' and 'b' and their children are the same, not looking at
+// their siblings
+bool
+node_equal(const node_t *a, const node_t *b)
+{
+  if (a->tkn != b->tkn || (a->text == nullptr) != (b->text == nullptr))
+    return false;
+  if (a->text && strcmp(a->text, b->text) != 0)
+    return false;
+  if (a->tkn == TKN_VALUE_INT && a->value.i != b->value.i)
+    return false;
+  if (a->tkn == TKN_VALUE_DOUBLE && memcmp(&a->value.d, &b->value.d, sizeof(double)) != 0)
+    return false;
+  const node_t *p = a->down, *q = b->down;
+  for(; p && q; p=p->next, q=q->next) {
+    if (!node_equal(p, q))
+      return false;
+  }
+  return p == q;
+}
+
 void
 node_append(node_t *n0, node_t *n1)
 {
@@ -686,6 +923,38 @@ node_pretty_print(FILE *out, node_t *n, unsigned indent)
       print_indent(out, indent);
       fprintf(out, "}\n");
       break;
+    case TKN_WHILE:
+      print_indent(out, indent);
+      fprintf(out, "while (");
+      node_pretty_print(out, n->down, indent);
+      fprintf(out, ") {\n");
+      node_pretty_print(out, n->down->next, indent+1);
+      print_indent(out, indent);
+      fprintf(out, "}\n");
+      break;
+    case TKN_DO:
+      print_indent(out, indent);
+      fprintf(out, "do {\n");
+      node_pretty_print(out, n->down, indent+1);
+      print_indent(out, indent);
+      fprintf(out, "} while (");
+      node_pretty_print(out, n->down->next, indent);
+      fprintf(out, ");\n");
+      break;
+    case TKN_FOR:
+      print_indent(out, indent);
+      fprintf(out, "for (");
+      for(node_t *p = n->down; p != n->down->next->next->next; p=p->next) {
+        if (p->tkn != TKN_NONE)
+          node_pretty_print(out, p, indent);
+        if (p->next != n->down->next->next->next)
+          fprintf(out, "; ");
+      }
+      fprintf(out, ") {\n");
+      node_pretty_print(out, n->down->next->next->next, indent+1);
+      print_indent(out, indent);
+      fprintf(out, "}\n");
+      break;
     case TKN_RETURN:
       print_indent(out, indent);
       fprintf(out, "return (");
@@ -705,6 +974,12 @@ node_pretty_print(FILE *out, node_t *n, unsigned indent)
     case TKN_GE:
     case '<':
     case '>':
+       // unary '-', '+' and '*' have a single operand
+       if (!n->down->next) {
+         fprintf(out, "%s", keywordByToken(n->tkn));
+         node_pretty_print(out, n->down, indent);
+         break;
+       }
        node_pretty_print(out, n->down);
        fprintf(out, "%s", keywordByToken(n->tkn));
        node_pretty_print(out, n->down->next, indent);
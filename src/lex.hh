@@ -1,4 +1,10 @@
+#ifndef LEX_HH_
+#define LEX_HH_
+
 #include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <functional>
 
 
 typedef enum {
@@ -124,12 +130,48 @@ typedef struct _node_t {
   struct _node_t *next, *down;
 } node_t;
 
-extern FILE* lex_in;
-node_t* parse(FILE *in);
+class NodeTable;
+class ThreadPool;
+
+// thrown for source that can't be lexed or parsed
+struct syntax_error: std::runtime_error {
+  syntax_error(const std::string &what): std::runtime_error(what) {}
+};
+
+extern thread_local FILE* lex_in;
+// start lexing 'in', forgetting what was read from before; with 'lines',
+// each line is lexed once it can be read instead of once a block can
+void lex_open(FILE *in, bool lines = false);
+// start lexing the characters from 'begin' to 'end', which must stay
+// until the last token is read
+void lex_open(const char *begin, const char *end);
+// hand out the tokens from 'begin' to 'end', as lexed by lex_all()
+void lex_open(node_t **begin, node_t **end);
+// where lexing the source in memory continues, after the last token
+const char* lex_position();
+// the next character after the last token, for reading raw text
+int lex_getc();
+// print the grammar rules applied while parsing
+extern bool parse_trace;
+// with 'shared', identical subtrees of the result are stored once in it
+node_t* parse(FILE *in, NodeTable *shared = nullptr);
+node_t* parse(const char *begin, const char *end, NodeTable *shared = nullptr);
+// parse 'in' a line at a time and pass each top level declaration to
+// 'declaration', which takes it, as soon as it is complete
+void parse_stream(FILE *in, const std::function<void(node_t*)> &declaration);
+// the top level declaration made of the tokens from 'begin' to 'end', which
+// it takes; NULL when they aren't one or need parsing from the source
+node_t* parse_declaration(node_t **begin, node_t **end);
+// the same as parse(begin, end, shared), parsing the top level declarations
+// on 'pool' and the calling thread
+node_t* parse_parallel(const char *begin, const char *end, ThreadPool &pool, NodeTable *shared = nullptr);
 node_t* lex();
 void unlex(node_t*);
 void lexfree(node_t*);
+void node_free(node_t*);
 void node_append(node_t*, node_t*);
+node_t* node_copy(node_t*);
+bool node_equal(const node_t *a, const node_t *b);
 void node_append_next(node_t*, node_t*);
 void node_print0(FILE *out, node_t *n, unsigned depth);
 inline void node_print(FILE *out, node_t *n) {
@@ -140,6 +182,10 @@ inline node_t *node_new(int tkn) {
   return node_new(static_cast<token_e>(tkn));
 }
 node_t *node_new_txt(token_e tkn, const char *txt);
+// replace the text of 'n' by a copy of 'text', which may be NULL
+void node_set_text(node_t *n, const char *text);
+// free 'n' alone, its text and children must have been moved elsewhere
+void node_dispose(node_t *n);
 node_t* node_new_int(const char *txt);
 node_t* node_new_double(const char *txt);
 node_t* node_new_value(int value);
@@ -147,3 +193,5 @@ node_t* node_new_value(double value);
 
 
 void node_pretty_print(FILE *out, node_t *n, unsigned indent=0);
+
+#endif // #ifndef LEX_HH_
@@ -1,11 +1,261 @@
-#include "lex.hh"
+#include "runtime.hh"
+#include "nodetable.hh"
+#include "threadpool.hh"
+#include "server.hh"
+#include "mapper.hh"
 
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+using namespace std;
 
 static bool trace = true;
+static bool dump_ir = false;
+static bool share_ast = false;
+static bool compile_all = false;
+static bool run = false;
+static const char *serve_path = nullptr;
+static const char *map_function = nullptr;
+static char delimiter = '\t';
+static Server *serving = nullptr;
+static unsigned jobs = 0; // threads for --compile-all, 0 for one per core
+
+struct compiled_t {
+  string path;
+  string error; // empty when it parsed
+  size_t declarations = 0;
+  double seconds = 0.0;
+};
+
+// the files below 'path', or 'path' itself when it isn't a directory
+static void
+find_files(const string &path, vector<string> &out)
+{
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    out.push_back(path);
+    return;
+  }
+  while(dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    string name = path + "/" + entry->d_name;
+    struct stat st;
+    if (stat(name.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      find_files(name, out);
+    else if (S_ISREG(st.st_mode))
+      out.push_back(name);
+  }
+  closedir(dir);
+}
+
+static void
+compile(compiled_t &file)
+{
+  auto start = chrono::steady_clock::now();
+  FILE *in = fopen(file.path.c_str(), "r");
+  if (!in) {
+    file.error = strerror(errno);
+    return;
+  }
+  try {
+    node_t *root = parse(in);
+    for(node_t *p = root ? root->down : nullptr; p; p=p->next)
+      ++file.declarations;
+    node_free(root);
+  }
+  catch(exception &e) {
+    file.error = e.what();
+  }
+  fclose(in);
+  file.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// parse every file below 'paths' on a work stealing pool, print the time
+// each took and then the errors
+static int
+compile_files(const vector<string> &paths)
+{
+  vector<string> names;
+  for(auto &path: paths)
+    find_files(path, names);
+  sort(names.begin(), names.end());
+  vector<compiled_t> files(names.size());
+  for(size_t i=0; i<names.size(); ++i)
+    files[i].path = names[i];
+
+  parse_trace = false;
+  unsigned threads = jobs ? jobs : max(thread::hardware_concurrency(), 1u);
+  auto start = chrono::steady_clock::now();
+  if (threads == 1) {
+    for(auto &file: files)
+      compile(file);
+  } else {
+    // the calling thread is one of them
+    ThreadPool pool(threads - 1);
+    atomic<size_t> done(0);
+    for(auto &file: files) {
+      pool.submit([&]() {
+        compile(file);
+        ++done;
+      });
+    }
+    pool.wait([&]() { return done == files.size(); });
+  }
+  double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  size_t failed = 0;
+  double busy = 0.0;
+  for(auto &file: files) {
+    if (file.error.empty())
+      printf("%10.2f ms %6zu declarations  %s\n", file.seconds * 1000.0, file.declarations, file.path.c_str());
+    else
+      printf("%10.2f ms %19s  %s\n", file.seconds * 1000.0, "FAILED", file.path.c_str());
+    busy += file.seconds;
+  }
+  for(auto &file: files) {
+    if (!file.error.empty()) {
+      fprintf(stderr, "%s: %s\n", file.path.c_str(), file.error.c_str());
+      ++failed;
+    }
+  }
+  printf("%zu files, %zu failed, %.1f ms parsing, %.1f ms on %u threads\n",
+         files.size(), failed, busy * 1000.0, wall * 1000.0, threads);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// insert the functions of 'path', "-" for stdin, while it is read and call
+// those without parameters as soon as they are in
+static int
+run_file(const char *path)
+{
+  FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  parse_trace = false;
+  Runtime rt;
+  int status = EXIT_SUCCESS;
+  try {
+    rt.insert(in, [&rt, &status, path](node_t *function) {
+      if (function->down->next->down)
+        return;
+      // a failed call, as of a function defined further down, doesn't
+      // stop the others
+      node_t *result;
+      string error;
+      try {
+        result = rt.call(function->text);
+      }
+      catch(ExecutionContext::script_error &e) {
+        error = e.what();
+      }
+      catch(ExecutionContext::stack_overflow &e) {
+        error = e.what();
+      }
+      catch(out_of_memory &e) {
+        error = e.what();
+      }
+      if (!error.empty()) {
+        fprintf(stderr, "%s: %s(): %s\n", path, function->text, error.c_str());
+        status = EXIT_FAILURE;
+        return;
+      }
+      if (result && result->tkn == TKN_VALUE_INT)
+        printf("%s() = %i\n", function->text, result->value.i);
+      else
+      if (result && result->tkn == TKN_VALUE_DOUBLE)
+        printf("%s() = %g\n", function->text, result->value.d);
+      else
+        printf("%s()\n", function->text);
+      fflush(stdout);
+    });
+  }
+  catch(syntax_error &e) {
+    fprintf(stderr, "%s: %s\n", path, e.what());
+    status = EXIT_FAILURE;
+  }
+  if (in != stdin)
+    fclose(in);
+  return status;
+}
+
+static void
+stop_serving(int)
+{
+  if (serving)
+    serving->stop();
+}
+
+// answer calls on the socket 'path' until interrupted
+static int
+serve(const char *path)
+{
+  parse_trace = false;
+  try {
+    Server server(path);
+    serving = &server;
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    fprintf(stderr, "serving on %s\n", path);
+    server.run();
+    serving = nullptr;
+  }
+  catch(system_error &e) {
+    fprintf(stderr, "%s: %s\n", path, e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// write map_function(fields...) for each line of stdin to stdout
+static int
+map_file(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  parse_trace = false;
+  Runtime rt;
+  try {
+    node_t *root = parse(in);
+    fclose(in);
+    for(node_t *p = root ? root->down : nullptr; p; p=p->next) {
+      if (p->tkn != TKN_FUNCTION)
+        throw syntax_error("only functions can be declared");
+    }
+    if (root)
+      rt.insert(root);
+  }
+  catch(exception &e) {
+    // not only parsing, compiling may fail as well
+    fprintf(stderr, "%s: %s\n", path, e.what());
+    return EXIT_FAILURE;
+  }
+  unsigned threads = jobs ? jobs : 1;
+  try {
+    Mapper mapper(rt.share(), map_function, threads, delimiter);
+    mapper.run(STDIN_FILENO, STDOUT_FILENO);
+  }
+  catch(exception &e) {
+    fprintf(stderr, "%s: %s\n", map_function, e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
 int
 main(int argc, char **argv)
@@ -14,13 +264,60 @@ main(int argc, char **argv)
   for(i=1; i<argc; ++i) {
     if (strcmp(argv[i], "--trace")==0)
       trace = true;
+    else
+    if (strcmp(argv[i], "--dump-ir")==0)
+      dump_ir = true;
+    else
+    if (strcmp(argv[i], "--share-ast")==0)
+      share_ast = true;
+    else
+    if (strcmp(argv[i], "--compile-all")==0)
+      compile_all = true;
+    else
+    if (strcmp(argv[i], "--run")==0)
+      run = true;
+    else
+    if (strcmp(argv[i], "--serve")==0 && i+1<argc)
+      serve_path = argv[++i];
+    else
+    if (strcmp(argv[i], "--map")==0 && i+1<argc)
+      map_function = argv[++i];
+    else
+    if (strcmp(argv[i], "-d")==0 && i+1<argc)
+      delimiter = argv[++i][0];
+    else
+    if (strcmp(argv[i], "-j")==0 && i+1<argc)
+      jobs = atoi(argv[++i]);
+    else
+    if (strncmp(argv[i], "-j", 2)==0 && isdigit(argv[i][2]))
+      jobs = atoi(argv[i] + 2);
     else
       break;
   }
+  if (serve_path)
+    return serve(serve_path);
   if (i==argc) {
     fprintf(stderr, "no input files\n");
     exit(EXIT_FAILURE);
   }
+  if (compile_all) {
+    // options may follow the directories
+    vector<string> paths;
+    for(; i<argc; ++i) {
+      if (strcmp(argv[i], "-j")==0 && i+1<argc)
+        jobs = atoi(argv[++i]);
+      else
+      if (strncmp(argv[i], "-j", 2)==0 && isdigit(argv[i][2]))
+        jobs = atoi(argv[i] + 2);
+      else
+        paths.push_back(argv[i]);
+    }
+    return compile_files(paths);
+  }
+  if (run)
+    return run_file(argv[i]);
+  if (map_function)
+    return map_file(argv[i]);
 
   auto in = fopen(argv[i], "r");
   if (!in) {
@@ -29,11 +326,27 @@ main(int argc, char **argv)
   }
 
 
-  auto root = compile(in);
-  if (root)
-    node_print(stdout, root);
-  else
+  NodeTable table;
+  node_t *root;
+  try {
+    root = parse(in, share_ast ? &table : nullptr);
+  }
+  catch(syntax_error &e) {
+    fprintf(stderr, "%s: %s\n", argv[i], e.what());
+    exit(EXIT_FAILURE);
+  }
+  if (share_ast)
+    fprintf(stderr, "%zu unique nodes in %zu bytes, %zu bytes saved\n",
+            table.nodes(), table.bytes(), table.saved());
+  if (!root)
     printf("empty file?\n");
+  else
+  if (dump_ir) {
+    Runtime rt;
+    rt.insert(root);
+    rt.dump(stdout);
+  } else
+    node_print(stdout, root);
 
   fclose(in);
   return EXIT_SUCCESS;
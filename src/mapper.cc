@@ -0,0 +1,219 @@
+#include "mapper.hh"
+#include "threadpool.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <system_error>
+
+using namespace std;
+
+// input read per thread and round, output written at once
+static const size_t CHUNK = 1 << 20;
+
+Mapper::Mapper(shared_ptr<const Program> program, const string &function, unsigned threads, char delimiter):
+  delimiter(delimiter)
+{
+  int n = program->arity(function);
+  if (n < 0)
+    throw record_error("unknown function '" + function + "'");
+  arity = n;
+  for(unsigned i=0; i<max(threads, 1u); ++i) {
+    unique_ptr<worker_t> worker(new worker_t);
+    worker->context.reset(new ExecutionContext(program));
+    worker->call.reset(new ExecutionContext::Call(*worker->context, function.c_str(), arity));
+    worker->out.reserve(CHUNK);
+    workers.push_back(move(worker));
+  }
+}
+
+Mapper::~Mapper()
+{
+}
+
+static void
+write_all(int out, const string &text)
+{
+  size_t written = 0;
+  while(written < text.size()) {
+    ssize_t n = write(out, text.data() + written, text.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw system_error(errno, generic_category(), "write");
+    written += n;
+  }
+}
+
+static void
+append_int(string &out, int value)
+{
+  char digits[16], *p = digits + sizeof(digits);
+  unsigned u = value < 0 ? 0u - (unsigned)value : value;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while(u);
+  if (value < 0)
+    *--p = '-';
+  out.append(p, digits + sizeof(digits) - p);
+}
+
+// the records from 'begin' to 'end', which ends with a newline
+void
+Mapper::map(worker_t &worker, char *begin, char *end)
+{
+  worker.records = 0;
+  worker.error.clear();
+  while(begin < end) {
+    char *eol = (char*)memchr(begin, '\n', end - begin);
+    char *last = eol > begin && eol[-1] == '\r' ? eol - 1 : eol;
+    *last = 0;
+    size_t count = 0;
+    for(char *field = begin; ; ++count) {
+      char *stop = (char*)memchr(field, delimiter, last - field);
+      if (!stop)
+        stop = last;
+      *stop = 0;
+      if (count < arity) {
+        node_t *arg = worker.call->arg(count);
+        char *rest;
+        errno = 0;
+        long i = strtol(field, &rest, 10);
+        if (rest != field && !*rest && !errno && i >= INT_MIN && i <= INT_MAX) {
+          arg->tkn = TKN_VALUE_INT;
+          arg->text = nullptr;
+          arg->value.i = i;
+        }
+        else {
+          double d = strtod(field, &rest);
+          if (rest != field && !*rest) {
+            arg->tkn = TKN_VALUE_DOUBLE;
+            arg->text = nullptr;
+            arg->value.d = d;
+          }
+          else {
+            arg->tkn = TKN_STRING;
+            arg->text = field;
+          }
+        }
+      }
+      if (stop == last)
+        break;
+      field = stop + 1;
+    }
+    if (count + 1 != arity && !(arity == 0 && last == begin)) {
+      worker.error = "expected " + to_string(arity) + " fields, got " + to_string(count + 1);
+      return;
+    }
+
+    node_t *result;
+    try {
+      result = worker.call->run();
+    }
+    catch(exception &e) {
+      worker.error = e.what();
+      return;
+    }
+    if (result && result->tkn == TKN_VALUE_INT)
+      append_int(worker.out, result->value.i);
+    else
+    if (result && result->tkn == TKN_VALUE_DOUBLE) {
+      char text[32];
+      worker.out.append(text, snprintf(text, sizeof(text), "%.17g", result->value.d));
+    }
+    else
+    if (result && result->tkn == TKN_TRUE)
+      worker.out += "true";
+    else
+    if (result && result->tkn == TKN_FALSE)
+      worker.out += "false";
+    else
+    if (result && result->text)
+      worker.out += result->text;
+    worker.out += '\n';
+    ++worker.records;
+    begin = eol + 1;
+  }
+}
+
+size_t
+Mapper::run(int in, int out)
+{
+  size_t threads = workers.size();
+  unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads - 1) : nullptr);
+  vector<char> buffer(threads * CHUNK);
+  size_t size = 0, records = 0;
+  bool eof = false;
+  while(!eof || size) {
+    if (!eof && size == buffer.size())
+      buffer.resize(buffer.size() * 2); // a record longer than the buffer
+    // pipes return less at a time, fill a batch for every thread
+    while(!eof && size < buffer.size()) {
+      ssize_t n = read(in, buffer.data() + size, buffer.size() - size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw system_error(errno, generic_category(), "read");
+      size += n;
+      eof = n == 0;
+    }
+    // the records complete so far, a last one without newline at the end
+    char *begin = buffer.data();
+    char *end = (char*)memrchr(begin, '\n', size);
+    if (eof && size && (!end || end != begin + size - 1)) {
+      if (size == buffer.size())
+        buffer.resize(size + 1);
+      begin = buffer.data();
+      begin[size++] = '\n';
+      end = begin + size - 1;
+    }
+    if (!end)
+      continue;
+    ++end;
+
+    // a batch per worker, split after a newline
+    vector<char*> starts;
+    starts.push_back(begin);
+    for(size_t i=1; i<threads; ++i) {
+      char *at = begin + (end - begin) * i / threads;
+      if (at < starts.back())
+        at = starts.back();
+      char *eol = at < end ? (char*)memchr(at, '\n', end - at) : nullptr;
+      starts.push_back(eol ? eol + 1 : end);
+    }
+    starts.push_back(end);
+    if (pool) {
+      atomic<size_t> done(0);
+      for(size_t i=0; i<threads; ++i) {
+        pool->submit([&, i]() {
+          try {
+            map(*workers[i], starts[i], starts[i + 1]);
+          }
+          catch(...) {
+            workers[i]->failure = current_exception();
+          }
+          ++done;
+        });
+      }
+      pool->wait([&]() { return done == threads; });
+    }
+    else {
+      map(*workers[0], begin, end);
+    }
+
+    for(auto &worker: workers) {
+      if (worker->failure)
+        rethrow_exception(worker->failure);
+      write_all(out, worker->out);
+      worker->out.clear();
+      records += worker->records;
+      if (!worker->error.empty())
+        throw record_error("record " + to_string(records + 1) + ": " + worker->error);
+    }
+    size -= end - begin;
+    memmove(begin, end, size);
+  }
+  return records;
+}
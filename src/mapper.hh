@@ -0,0 +1,48 @@
+#ifndef MAPPER_HH_
+#define MAPPER_HH_
+
+#include "runtime.hh"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <exception>
+
+// thrown for a record that doesn't fit the function
+struct record_error: std::runtime_error {
+  record_error(const std::string &what): std::runtime_error(what) {}
+};
+
+// Calls a script function for each line of delimited text, with the
+// fields as arguments: integers, doubles or else strings. Each result is
+// written on a line of its own, in the order of the input. The fields
+// are read where they are in the input buffer, which is split into a
+// batch per thread.
+class Mapper {
+    struct worker_t {
+      std::unique_ptr<ExecutionContext> context;
+      std::unique_ptr<ExecutionContext::Call> call;
+      std::string out;
+      size_t records = 0;
+      std::string error; // for the record after the last one done
+      std::exception_ptr failure; // thrown on a pool thread
+    };
+    std::vector<std::unique_ptr<worker_t>> workers;
+    size_t arity;
+    char delimiter;
+
+  public:
+    // throws record_error if 'function' isn't a script function
+    Mapper(std::shared_ptr<const Program> program, const std::string &function,
+           unsigned threads = 1, char delimiter = '\t');
+    ~Mapper();
+    // map the records read from 'in' until its end to 'out'; returns how
+    // many there were, throws record_error and std::system_error
+    size_t run(int in, int out);
+
+  private:
+    void map(worker_t &worker, char *begin, char *end);
+};
+
+#endif // #ifndef MAPPER_HH_
@@ -0,0 +1,46 @@
+#include "memory.hh"
+
+#include <atomic>
+#include <thread>
+#include <functional>
+
+using namespace std;
+
+// Threads count in different cache lines so that those lexing and
+// parsing at the same time don't contend for one. Memory may be released
+// by another thread than the one that allocated it, so a shard alone can
+// be negative.
+static const unsigned SHARDS = 16;
+static struct alignas(64) shard_t {
+  atomic<ptrdiff_t> used[MEMORY_KINDS];
+} shards[SHARDS];
+static thread_local shard_t *shard = &shards[hash<thread::id>()(this_thread::get_id()) % SHARDS];
+
+size_t
+memory_used(memory_kind_t kind)
+{
+  ptrdiff_t used = 0;
+  for(auto &s: shards)
+    used += s.used[kind].load(memory_order_relaxed);
+  return used;
+}
+
+void
+memory_allocated(memory_kind_t kind, size_t bytes)
+{
+  shard->used[kind].fetch_add(bytes, memory_order_relaxed);
+}
+
+void
+memory_released(memory_kind_t kind, size_t bytes)
+{
+  shard->used[kind].fetch_sub(bytes, memory_order_relaxed);
+}
+
+void
+memory_print(FILE *out)
+{
+  static const char *names[MEMORY_KINDS] = { "lexer", "ast", "values", "native" };
+  for(int kind=0; kind<MEMORY_KINDS; ++kind)
+    fprintf(out, "%-8s %10zu bytes\n", names[kind], memory_used((memory_kind_t)kind));
+}
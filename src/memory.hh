@@ -0,0 +1,29 @@
+#ifndef MEMORY_HH_
+#define MEMORY_HH_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+
+// What memory is used for.
+enum memory_kind_t {
+  MEMORY_LEXER,  // token text buffers
+  MEMORY_AST,    // nodes and their text, from the parser and optimizer
+  MEMORY_VALUES, // heaps of script values
+  MEMORY_NATIVE, // arguments marshaled for native functions
+  MEMORY_KINDS
+};
+
+// bytes currently allocated for 'kind' by all threads
+size_t memory_used(memory_kind_t kind);
+void memory_allocated(memory_kind_t kind, size_t bytes);
+void memory_released(memory_kind_t kind, size_t bytes);
+void memory_print(FILE *out);
+
+// thrown when a call would exceed the memory limit of its context
+struct out_of_memory: std::runtime_error {
+  out_of_memory(const std::string &what): std::runtime_error(what) {}
+};
+
+#endif // #ifndef MEMORY_HH_
@@ -0,0 +1,84 @@
+#include "nodetable.hh"
+
+#include <string.h>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+static size_t
+node_size(const node_t *n)
+{
+  return sizeof(node_t) + (n->text ? strlen(n->text) + 1 : 0);
+}
+
+size_t
+NodeTable::hash_t::operator()(const node_t *n) const
+{
+  size_t h = n->tkn;
+  if (n->text) {
+    for(const char *p = n->text; *p; ++p)
+      h = h * 31 + (unsigned char)*p;
+  }
+  if (n->tkn == TKN_VALUE_INT)
+    h = h * 31 + n->value.i;
+  else if (n->tkn == TKN_VALUE_DOUBLE)
+    h = h * 31 + std::hash<double>()(n->value.d);
+  h = h * 31 + std::hash<const void*>()(n->down);
+  h = h * 31 + std::hash<const void*>()(n->next);
+  return h;
+}
+
+bool
+NodeTable::equal_t::operator()(const node_t *a, const node_t *b) const
+{
+  if (a->tkn != b->tkn || a->down != b->down || a->next != b->next)
+    return false;
+  if ((a->text == nullptr) != (b->text == nullptr))
+    return false;
+  if (a->text && strcmp(a->text, b->text) != 0)
+    return false;
+  // the value is only set for literals
+  if (a->tkn == TKN_VALUE_INT)
+    return a->value.i == b->value.i;
+  if (a->tkn == TKN_VALUE_DOUBLE)
+    return memcmp(&a->value.d, &b->value.d, sizeof(double)) == 0;
+  return true;
+}
+
+NodeTable::~NodeTable()
+{
+  for(auto n: unique) {
+    node_set_text(n, nullptr);
+    node_dispose(n);
+  }
+}
+
+node_t*
+NodeTable::intern(node_t *n)
+{
+  // siblings last to first, lists of statements and declarations can be long
+  vector<node_t*> siblings;
+  for(; n; n=n->next) {
+    if (owns(n))
+      break;
+    siblings.push_back(n);
+  }
+  node_t *next = n;
+  for(auto p = siblings.rbegin(); p != siblings.rend(); ++p) {
+    node_t *node = *p;
+    node->down = intern(node->down);
+    node->next = next;
+    auto found = unique.insert(node);
+    if (found.second) {
+      kept += node_size(node);
+      next = node;
+      continue;
+    }
+    freed += node_size(node);
+    node_set_text(node, nullptr);
+    node_dispose(node);
+    next = *found.first;
+  }
+  return next;
+}
@@ -0,0 +1,45 @@
+#ifndef NODETABLE_HH_
+#define NODETABLE_HH_
+
+#include "lex.hh"
+
+#include <stddef.h>
+#include <unordered_set>
+
+// Keeps one copy of structurally identical subtrees. Two nodes are
+// identical when their token, text and value are equal and their children
+// and following siblings are the same unique nodes, so a subtree can be
+// compared by pointer once interned. The table owns the nodes it returns;
+// they must not be changed or freed and are released with the table.
+class NodeTable {
+  public:
+    NodeTable() {}
+    ~NodeTable();
+    NodeTable(const NodeTable&) = delete;
+    NodeTable& operator=(const NodeTable&) = delete;
+
+    // the unique equivalent of 'n' and its siblings; takes 'n', freeing
+    // the nodes that already had an equivalent
+    node_t* intern(node_t *n);
+    bool owns(node_t *n) const {
+      auto found = unique.find(n);
+      return found != unique.end() && *found == n;
+    }
+    size_t nodes() const { return unique.size(); }
+    // bytes of the unique nodes
+    size_t bytes() const { return kept; }
+    // bytes of the duplicates that were freed
+    size_t saved() const { return freed; }
+
+  private:
+    struct hash_t {
+      size_t operator()(const node_t *n) const;
+    };
+    struct equal_t {
+      bool operator()(const node_t *a, const node_t *b) const;
+    };
+    std::unordered_set<node_t*, hash_t, equal_t> unique;
+    size_t kept = 0, freed = 0;
+};
+
+#endif // #ifndef NODETABLE_HH_
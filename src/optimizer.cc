@@ -0,0 +1,482 @@
+#include "optimizer.hh"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <chrono>
+#include <set>
+#include <string>
+
+using namespace std;
+
+PassManager::PassManager()
+{
+  add("fold", pass_fold);
+  add("reduce", pass_reduce);
+  add("dce", pass_dce);
+}
+
+void
+PassManager::add(const char *name, std::function<bool(node_t*)> pass)
+{
+  passes.push_back(pass_t{name, pass, 0.0, 0});
+}
+
+void
+PassManager::run(node_t *function)
+{
+  assert(function->tkn == TKN_FUNCTION);
+  // iterate until no pass finds anything left to do
+  for(unsigned round=0; round<8; ++round) {
+    bool changed = false;
+    for(auto &pass: passes) {
+      auto start = chrono::steady_clock::now();
+      bool result = pass.run(function);
+      pass.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      if (result) {
+        ++pass.changes;
+        changed = true;
+      }
+    }
+    if (!changed)
+      break;
+  }
+}
+
+void
+PassManager::add_statistics(const PassManager &other)
+{
+  assert(passes.size() == other.passes.size());
+  for(size_t i=0; i<passes.size(); ++i) {
+    passes[i].seconds += other.passes[i].seconds;
+    passes[i].changes += other.passes[i].changes;
+  }
+}
+
+void
+PassManager::print_timing(FILE *out)
+{
+  fprintf(out, "%-16s %8s %12s\n", "pass", "changes", "time [ms]");
+  for(auto &pass: passes) {
+    fprintf(out, "%-16s %8u %12.3f\n", pass.name, pass.changes, pass.seconds * 1000.0);
+  }
+}
+
+// replace the contents of 'n' with those of 'with' while keeping n->next
+static void
+node_replace(node_t *n, node_t *with)
+{
+  assert(!with->next);
+  n->tkn = with->tkn;
+  n->text = with->text;
+  n->value = with->value;
+  n->down = with->down;
+  node_dispose(with);
+}
+
+// false when there is no result, the division overflowing included
+bool
+node_arith(int tkn, int a, int b, int *result)
+{
+  switch(tkn) {
+    // wrap around instead of overflowing
+    case '+': *result = (int)((unsigned)a + (unsigned)b); break;
+    case '-': *result = (int)((unsigned)a - (unsigned)b); break;
+    case '*': *result = (int)((unsigned)a * (unsigned)b); break;
+    case '/':
+      if (b == 0 || (a == INT_MIN && b == -1))
+        return false;
+      *result = a / b;
+      break;
+    case '%':
+      if (b == 0 || (a == INT_MIN && b == -1))
+        return false;
+      *result = a % b;
+      break;
+    case TKN_SHL:
+    case TKN_SHR:
+      if (b < 0 || b > 31)
+        return false;
+      *result = tkn == TKN_SHL ? (int)((unsigned)a << b) : a >> b;
+      break;
+    case '<':     *result = a < b; break;
+    case '>':     *result = a > b; break;
+    case TKN_LE:  *result = a <= b; break;
+    case TKN_GE:  *result = a >= b; break;
+    case TKN_EQ:  *result = a == b; break;
+    case TKN_NEQ: *result = a != b; break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// the operators with a single operand that have an int result
+bool
+node_unary(int tkn, int a, int *result)
+{
+  switch(tkn) {
+    case '+': *result = a; break;
+    case '-': *result = (int)(0u - (unsigned)a); break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+static bool
+fold(node_t *n)
+{
+  bool changed = false;
+  for(node_t *p = n->down; p; p=p->next)
+    changed |= fold(p);
+
+  switch(n->tkn) {
+    case TKN_EXPRESSION:
+      // a single expression only forwards the value of its operand
+      if (n->down && !n->down->next) {
+        node_replace(n, n->down);
+        return true;
+      }
+      break;
+    default: {
+      node_t *n0 = n->down, *n1 = n0 ? n0->next : 0;
+      int result;
+      if ( n0 && !n1 && n0->tkn == TKN_VALUE_INT &&
+           node_unary(n->tkn, n0->value.i, &result) )
+      {
+        n->tkn = TKN_VALUE_INT;
+        n->value.i = result;
+        n->down = 0;
+        node_free(n0);
+        return true;
+      }
+      if ( n1 && !n1->next &&
+           n0->tkn == TKN_VALUE_INT && n1->tkn == TKN_VALUE_INT &&
+           node_arith(n->tkn, n0->value.i, n1->value.i, &result) )
+      {
+        n->tkn = TKN_VALUE_INT;
+        n->value.i = result;
+        n->down = 0;
+        n0->next = 0;
+        node_free(n0);
+        node_free(n1);
+        return true;
+      }
+    } break;
+  }
+  return changed;
+}
+
+bool
+pass_fold(node_t *function)
+{
+  return fold(function->down->next->next);
+}
+
+// true when evaluating 'n' can neither change state nor leave the function
+bool
+node_is_pure(node_t *n)
+{
+  switch(n->tkn) {
+    case TKN_VALUE_INT:
+    case TKN_VALUE_DOUBLE:
+    case TKN_STRING:
+    case TKN_IDENTIFIER:
+    case TKN_TRUE:
+    case TKN_FALSE:
+      return true;
+    case TKN_EXPRESSION:
+    case TKN_STATEMENT_SEQ:
+    case '+':
+    case '-':
+    case '*':
+    case TKN_EQ:
+    case TKN_NEQ:
+    case TKN_LE:
+    case TKN_GE:
+    case '<':
+    case '>':
+      // unary '*' fails
+      if (n->tkn == '*' && n->down && !n->down->next)
+        return false;
+      for(node_t *p = n->down; p; p=p->next) {
+        if (!node_is_pure(p))
+          return false;
+      }
+      return true;
+    case TKN_SHL:
+    case TKN_SHR: {
+      // a shift can only fail by its count
+      node_t *count = n->down->next;
+      return count && node_is_pure(n->down) && count->tkn == TKN_VALUE_INT &&
+             count->value.i >= 0 && count->value.i <= 31;
+    }
+  }
+  return false;
+}
+
+// no value, as from an unknown identifier, is false
+bool
+node_is_true(node_t *n)
+{
+  if (!n)
+    return false;
+  switch(n->tkn) {
+    case TKN_VALUE_INT:
+      return n->value.i != 0;
+    case TKN_VALUE_DOUBLE:
+      return n->value.d != 0.0;
+    case TKN_TRUE:
+      return true;
+  }
+  return false;
+}
+
+// true when executing 'n' always leaves the function
+static bool
+returns(node_t *n)
+{
+  switch(n->tkn) {
+    case TKN_RETURN:
+      return true;
+    case TKN_STATEMENT_SEQ:
+      for(node_t *p = n->down; p; p=p->next) {
+        if (returns(p))
+          return true;
+      }
+      return false;
+    case TKN_IF:
+      return n->down->next->next && returns(n->down->next) && returns(n->down->next->next);
+  }
+  return false;
+}
+
+static bool
+dce(node_t *n)
+{
+  bool changed = false;
+  for(node_t *p = n->down; p; p=p->next)
+    changed |= dce(p);
+
+  switch(n->tkn) {
+    case TKN_STATEMENT_SEQ: {
+      node_t **link = &n->down;
+      while(*link) {
+        node_t *p = *link;
+        if (node_is_pure(p)) {
+          *link = p->next;
+          p->next = 0;
+          node_free(p);
+          changed = true;
+          continue;
+        }
+        if (p->tkn == TKN_STATEMENT_SEQ) {
+          // blocks don't introduce scopes yet
+          node_t *last = p->down;
+          while(last->next)
+            last = last->next;
+          last->next = p->next;
+          *link = p->down;
+          node_dispose(p);
+          changed = true;
+          continue;
+        }
+        if (returns(p) && p->next) {
+          // unreachable
+          node_free(p->next);
+          p->next = 0;
+          changed = true;
+        }
+        link = &p->next;
+      }
+    } break;
+    case TKN_IF: {
+      node_t *condition = n->down;
+      switch(condition->tkn) {
+        case TKN_VALUE_INT:
+        case TKN_VALUE_DOUBLE:
+        case TKN_TRUE:
+        case TKN_FALSE:
+          break;
+        default:
+          return changed;
+      }
+      // keep only the branch which will be taken
+      node_t *then = condition->next, *otherwise = then->next;
+      node_t *taken = node_is_true(condition) ? then : otherwise;
+      if (!taken)
+        taken = node_new(TKN_STATEMENT_SEQ);
+      condition->next = then->next = 0;
+      if (taken != then)
+        node_free(then);
+      if (taken != otherwise)
+        node_free(otherwise);
+      node_free(condition);
+      n->down = 0;
+      node_replace(n, taken);
+      changed = true;
+    } break;
+  }
+  return changed;
+}
+
+bool
+pass_dce(node_t *function)
+{
+  return dce(function->down->next->next);
+}
+
+// true when 'n' evaluates to an int, given the parameters declared int
+static bool
+int_valued(node_t *n, const set<string> &ints)
+{
+  switch(n->tkn) {
+    case TKN_VALUE_INT:
+      return true;
+    case TKN_IDENTIFIER:
+      return ints.find(n->text) != ints.end();
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case TKN_SHL:
+    case TKN_SHR:
+    case '<':
+    case '>':
+    case TKN_LE:
+    case TKN_GE:
+    case TKN_EQ:
+    case TKN_NEQ:
+      // unary '-' and '+' of an int, but not unary '*'
+      if (!n->down->next)
+        return (n->tkn == '-' || n->tkn == '+') && int_valued(n->down, ints);
+      return int_valued(n->down, ints) && int_valued(n->down->next, ints);
+  }
+  return false;
+}
+
+// replace 'n' by the constant 'value'
+static void
+node_constant(node_t *n, int value)
+{
+  node_free(n->down);
+  n->tkn = TKN_VALUE_INT;
+  n->value.i = value;
+  n->down = 0;
+}
+
+// replace 'n' by its operand 'keep', freeing the other one
+static void
+node_forward(node_t *n, node_t *keep)
+{
+  node_t *other = keep == n->down ? keep->next : n->down;
+  n->down = 0;
+  keep->next = other->next = 0;
+  node_free(other);
+  node_replace(n, keep);
+}
+
+static bool
+reduce(node_t *n, const set<string> &ints)
+{
+  bool changed = false;
+  for(node_t *p = n->down; p; p=p->next)
+    changed |= reduce(p, ints);
+
+  node_t *a = n->down, *b = a ? a->next : 0;
+  if (!b || b->next)
+    return changed;
+  switch(n->tkn) {
+    case '+':
+    case '-':
+    case '*':
+    case TKN_SHL:
+    case TKN_SHR:
+    case '<':
+    case '>':
+    case TKN_LE:
+    case TKN_GE:
+    case TKN_EQ:
+    case TKN_NEQ:
+      break;
+    default:
+      return changed;
+  }
+  // a double operand may behave differently or fail
+  if (!int_valued(a, ints) || !int_valued(b, ints))
+    return changed;
+
+  // equal operands: compute the value once, if at all
+  if (node_is_pure(a) && node_equal(a, b)) {
+    switch(n->tkn) {
+      case '-':
+      case '<':
+      case '>':
+      case TKN_NEQ:
+        node_constant(n, 0);
+        return true;
+      case TKN_LE:
+      case TKN_GE:
+      case TKN_EQ:
+        node_constant(n, 1);
+        return true;
+      case '+':
+        n->tkn = TKN_SHL;
+        node_free(b);
+        a->next = node_new_value(1);
+        return true;
+    }
+  }
+
+  // the constant operand of a commutative operator second
+  if ((n->tkn == '+' || n->tkn == '*') && a->tkn == TKN_VALUE_INT && b->tkn != TKN_VALUE_INT) {
+    a->next = 0;
+    b->next = a;
+    n->down = b;
+    swap(a, b);
+  }
+  if (b->tkn != TKN_VALUE_INT)
+    return changed;
+  int v = b->value.i;
+  switch(n->tkn) {
+    case '+':
+    case '-':
+    case TKN_SHL:
+    case TKN_SHR:
+      if (v == 0) {
+        node_forward(n, a);
+        return true;
+      }
+      break;
+    case '*':
+      if (v == 1) {
+        node_forward(n, a);
+        return true;
+      }
+      if (v == 0 && node_is_pure(a)) {
+        node_constant(n, 0);
+        return true;
+      }
+      // x * 2^k is x << k, wrapping around alike
+      if (v > 1 && (v & (v - 1)) == 0) {
+        n->tkn = TKN_SHL;
+        b->value.i = __builtin_ctz(v);
+        return true;
+      }
+      break;
+  }
+  return changed;
+}
+
+bool
+pass_reduce(node_t *function)
+{
+  set<string> ints;
+  for(node_t *p = function->down->next->down; p; p=p->next) {
+    if (p->down && p->down->tkn == TKN_INT && p->down->next)
+      ints.insert(p->down->next->text);
+  }
+  return reduce(function->down->next->next, ints);
+}
@@ -0,0 +1,42 @@
+#ifndef OPTIMIZER_HH_
+#define OPTIMIZER_HH_
+
+#include "lex.hh"
+
+#include <vector>
+#include <functional>
+
+// Runs a sequence of tree rewriting passes over a TKN_FUNCTION node.
+//
+// Function bodies contain no assignments, so the tree is already in single
+// assignment form and serves as the optimizer's IR. Without local variables
+// to keep a value in, a common subexpression is only computed once where
+// an operator combines it with itself.
+class PassManager {
+    struct pass_t {
+      const char *name;
+      std::function<bool(node_t*)> run;
+      double seconds;
+      unsigned changes;
+    };
+    std::vector<pass_t> passes;
+  public:
+    PassManager();
+    void add(const char *name, std::function<bool(node_t*)> pass);
+    void run(node_t *function);
+    // carry on the counts of 'other', which has the same passes
+    void add_statistics(const PassManager &other);
+    void print_timing(FILE *out);
+};
+
+bool node_is_pure(node_t *n);
+bool node_is_true(node_t *n);
+bool node_arith(int tkn, int a, int b, int *result);
+bool node_unary(int tkn, int a, int *result);
+
+bool pass_fold(node_t *function);
+// strength reduction and equal operands, for operands known to be int
+bool pass_reduce(node_t *function);
+bool pass_dce(node_t *function);
+
+#endif // #ifndef OPTIMIZER_HH_
@@ -0,0 +1,191 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+static int
+int_value(node_t *n, const char *context)
+{
+  if (!n || n->tkn != TKN_VALUE_INT)
+    throw ExecutionContext::script_error(string(context) + ": expected an int");
+  return n->value.i;
+}
+
+static const char*
+function_name(node_t *n, const char *context)
+{
+  if (!n || n->tkn != TKN_IDENTIFIER)
+    throw ExecutionContext::script_error(string(context) + ": expected a function name");
+  return n->text;
+}
+
+void
+ExecutionContext::threads(unsigned size)
+{
+  lock_guard<mutex> guard(tasks_lock);
+  pool_size = size;
+  pool.reset();
+}
+
+ThreadPool&
+ExecutionContext::workers()
+{
+  lock_guard<mutex> guard(tasks_lock);
+  if (!pool)
+    pool.reset(new ThreadPool(pool_size ? pool_size : thread::hardware_concurrency()));
+  return *pool;
+}
+
+// call script function 'name' with evaluated arguments in a frame of its own
+node_t*
+ExecutionContext::invoke(const char *name, const vector<node_t*> &args)
+{
+  node_t *call = node_new(TKN_FUNCTION_CALL);
+  node_append(call, node_new_txt(TKN_IDENTIFIER, name));
+  node_t *list = node_new(TKN_EXPRESSION_LIST);
+  node_append(call, list);
+  for(auto arg: args)
+    node_append(list, node_copy(arg));
+  frame_t frame;
+  node_t *result;
+  try {
+    result = eval(call, frame);
+  }
+  catch(...) {
+    node_free(call);
+    throw;
+  }
+  // the result might be one of the arguments
+  if (result)
+    result = node_copy(result);
+  node_free(call);
+  return result;
+}
+
+// parallel_for(begin, end, function) calls function(i) for begin <= i < end
+node_t*
+ExecutionContext::parallel_for(node_t *args, frame_t &frame)
+{
+  if (!args || !args->next || !args->next->next)
+    throw script_error("parallel_for(begin, end, function) expected");
+  int begin = int_value(eval(args, frame), "parallel_for");
+  int end = int_value(eval(args->next, frame), "parallel_for");
+  const char *name = function_name(args->next->next, "parallel_for");
+  if (end <= begin)
+    return nullptr;
+
+  ThreadPool &pool = workers();
+  long count = (long)end - begin;
+  unsigned chunks = min<long>(count, pool.size() * 4);
+  atomic<unsigned> pending(chunks);
+  mutex failure_lock;
+  exception_ptr failure;
+  for(unsigned c=0; c<chunks; ++c) {
+    int from = begin + count * c / chunks;
+    int to = begin + count * (c+1) / chunks;
+    pool.submit([this, name, from, to, &pending, &failure_lock, &failure] {
+      try {
+        ExecutionContext context(*this);
+        for(int i=from; i<to; ++i) {
+          node_t *index = node_new_value(i);
+          node_t *result;
+          try {
+            result = context.invoke(name, { index });
+          }
+          catch(...) {
+            node_free(index);
+            throw;
+          }
+          node_free(result);
+          node_free(index);
+        }
+      }
+      catch(...) {
+        lock_guard<mutex> guard(failure_lock);
+        if (!failure)
+          failure = current_exception();
+      }
+      --pending;
+    });
+  }
+  // help instead of blocking so that nested loops can't starve the pool
+  pool.wait([&pending] { return pending == 0; });
+  if (failure)
+    rethrow_exception(failure);
+  return nullptr;
+}
+
+// spawn(function, args...) starts function(args...) and returns a handle for join
+node_t*
+ExecutionContext::spawn(node_t *args, frame_t &frame)
+{
+  const char *name = function_name(args, "spawn");
+  // values own neither their text nor other values, plain copies will do
+  vector<node_t> values;
+  for(node_t *e = args->next; e; e=e->next) {
+    node_t *value = eval(e, frame);
+    node_t none = { TKN_NONE };
+    values.push_back(value ? *value : none);
+  }
+
+  shared_ptr<task_t> task(new task_t);
+  task->done = false;
+  // this context may be gone before the task runs
+  task->context.reset(new ExecutionContext(*this));
+  int handle;
+  {
+    lock_guard<mutex> guard(tasks_lock);
+    handle = next_task++;
+    tasks[handle] = task;
+  }
+  workers().submit([name, values, task] {
+    try {
+      Call call(*task->context, name, values.size());
+      for(size_t i=0; i<values.size(); ++i) {
+        node_t *slot = call.arg(i);
+        node_t *next = slot->next;
+        *slot = values[i];
+        slot->next = next;
+        slot->down = nullptr;
+      }
+      if (node_t *result = call.run()) {
+        task->result = *result;
+        task->result.next = task->result.down = nullptr;
+        task->returned = true;
+      }
+    }
+    catch(...) {
+      task->failure = current_exception();
+    }
+    // the last context sharing the pool must not be freed on a worker
+    task->context.reset();
+    task->done = true;
+  });
+  return value(handle);
+}
+
+// join(handle) waits for a spawned function and returns its result
+node_t*
+ExecutionContext::join(node_t *args, frame_t &frame)
+{
+  int handle = int_value(args ? eval(args, frame) : nullptr, "join");
+  shared_ptr<task_t> task;
+  {
+    lock_guard<mutex> guard(tasks_lock);
+    auto t = tasks.find(handle);
+    if (t == tasks.end())
+      throw script_error("join: unknown handle " + to_string(handle));
+    task = t->second;
+    tasks.erase(t);
+  }
+  workers().wait([&task] { return task->done.load(); });
+  if (task->failure)
+    rethrow_exception(task->failure);
+  if (!task->returned)
+    return nullptr;
+  node_t *result = value(0);
+  *result = task->result;
+  return result;
+}
@@ -1,13 +1,22 @@
 #include "lex.hh"
+#include "nodetable.hh"
+#include "tokens.hh"
+#include "threadpool.hh"
 
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <exception>
+
+using namespace std;
 
 // C++ Grammar (From the Annex A of ISO/IEC 14882:1998 (The C++ Standard)
 
-static bool trace = true;
+bool parse_trace = true;
 
 // A.1 Keywords
 // typedef-name
@@ -186,19 +195,185 @@ static node_t* class_name();
 void
 error(const char *message)
 {
-  fprintf(stderr, "%s\n", message);
-  exit(EXIT_FAILURE);
+  string what(message);
+  if (!what.empty() && what.back() == '\n')
+    what.pop_back();
+  throw syntax_error(what);
+}
+
+static node_t*
+parse0(NodeTable *shared)
+{
+  node_t *result;
+  try {
+    result = translation_unit();
+  }
+  catch(...) {
+    lex_in = nullptr;
+    throw;
+  }
+  lex_in = nullptr;
+  if (shared)
+    result = shared->intern(result);
+  return result;
+}
+
+node_t*
+parse(FILE *in, NodeTable *shared)
+{
+  if (lex_in)
+    error("lex/parse are not re-entrant");
+  lex_open(in);
+  return parse0(shared);
 }
 
 node_t*
-parse(FILE *in)
+parse(const char *begin, const char *end, NodeTable *shared)
 {
   if (lex_in)
     error("lex/parse are not re-entrant");
-  lex_in = in;
-  auto result = translation_unit();
+  lex_open(begin, end);
+  return parse0(shared);
+}
+
+void
+parse_stream(FILE *in, const function<void(node_t*)> &each)
+{
+  if (lex_in)
+    error("lex/parse are not re-entrant");
+  lex_open(in, true);
+  try {
+    while(node_t *decl = declaration())
+      each(decl);
+  }
+  catch(...) {
+    lex_in = nullptr;
+    throw;
+  }
   lex_in = nullptr;
-  return result;
+}
+
+// tasks per thread for parsing declarations in parallel
+static const size_t PARSE_TASKS = 4;
+
+// frees the tokens lex() has not handed out yet
+static void
+lex_drop()
+{
+  while(node_t *n = lex())
+    lexfree(n);
+}
+
+node_t*
+parse_declaration(node_t **begin, node_t **end)
+{
+  // a here-document needs the characters after the call
+  for(node_t **p = begin; p + 1 < end; ++p) {
+    if (p[0]->tkn == ')' && p[1]->tkn == TKN_SHL) {
+      for(p = begin; p < end; ++p)
+        lexfree(*p);
+      return 0;
+    }
+  }
+  lex_open(begin, end);
+  node_t *decl = 0;
+  try {
+    decl = declaration();
+    node_t *rest = lex();
+    if (rest) {
+      lexfree(rest);
+      node_free(decl);
+      decl = 0;
+    }
+  }
+  catch(...) {
+    lex_drop();
+    throw;
+  }
+  lex_drop();
+  return decl;
+}
+
+// The top level declarations end with a ';' or '}' outside of braces and
+// parentheses, so their tokens are known before parsing. Each is parsed
+// on its own; when that doesn't give what parsing in sequence does, the
+// source is parsed in sequence instead.
+node_t*
+parse_parallel(const char *begin, const char *end, ThreadPool &pool, NodeTable *shared)
+{
+  vector<node_t*> tokens;
+  try {
+    tokens = lex_parallel(begin, end, pool);
+  }
+  catch(syntax_error&) {
+    return parse(begin, end, shared); // maybe in a here-document
+  }
+
+  vector<size_t> starts;
+  if (!tokens.empty())
+    starts.push_back(0);
+  int depth = 0;
+  for(size_t i=0; i<tokens.size(); ++i) {
+    switch(tokens[i]->tkn) {
+      case '{': case '(': ++depth; break;
+      case '}': case ')': --depth; break;
+    }
+    // the next token starts the next declaration
+    if (depth == 0 && (tokens[i]->tkn == ';' || tokens[i]->tkn == '}'))
+      starts.push_back(i + 1);
+  }
+  if (!starts.empty() && starts.back() == tokens.size())
+    starts.pop_back();
+
+  size_t count = starts.size();
+  starts.push_back(tokens.size());
+  vector<node_t*> declarations(count, nullptr);
+  atomic<bool> failed(false);
+  // a few tasks per thread, each parsing consecutive declarations
+  size_t tasks = min<size_t>(count, (pool.size() + 1) * PARSE_TASKS);
+  atomic<size_t> done(0);
+  for(size_t task=0; task<tasks; ++task) {
+    pool.submit([&, task]() {
+      for(size_t i = count * task / tasks; i < count * (task + 1) / tasks; ++i) {
+        if (failed) {
+          for(size_t t = starts[i]; t < starts[i + 1]; ++t)
+            lexfree(tokens[t]);
+          continue;
+        }
+        try {
+          declarations[i] = parse_declaration(&tokens[starts[i]], &tokens[starts[i + 1]]);
+        }
+        catch(syntax_error&) {
+        }
+        if (!declarations[i])
+          failed = true;
+      }
+      ++done;
+    });
+  }
+  pool.wait([&]() { return done == tasks; });
+
+  if (failed) {
+    // in sequence, for its result or its error
+    for(auto n: declarations)
+      node_free(n);
+    return parse(begin, end, shared);
+  }
+
+  node_t *seq = 0, *last = 0;
+  for(auto decl: declarations) {
+    if (!seq) {
+      seq = node_new(TKN_DECLARATION_SEQ);
+      seq->down = decl;
+    } else {
+      last->next = decl;
+    }
+    for(last = decl; last->next; last = last->next)
+      ;
+  }
+  if (shared)
+    seq = shared->intern(seq);
+  return seq;
 }
 
 static node_t*
@@ -253,48 +428,44 @@ primary_expression()
   if (!n0)
     return 0;
   if (n0->tkn == TKN_IDENTIFIER) {
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> identifier\n");
     return n0;
   }
   if ( n0->tkn == TKN_VALUE_INT ||
        n0->tkn == TKN_VALUE_DOUBLE )
   {
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> value\n");
     return n0;
   }
   if (n0->tkn == TKN_STRING) {
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> string\n");
     return n0;
   }
   if (n0->tkn == TKN_TRUE || n0->tkn == TKN_FALSE) {
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> boolean\n");
     return n0;
   }
   if (n0->tkn=='(') {
     node_t *n1 = expression();
-    if (!n1) {
-      fprintf(stderr, "unexpected EOF after '(' in primary_expression\n");
-      exit(EXIT_FAILURE);
-    }
+    if (!n1)
+      error("unexpected EOF after '(' in primary_expression");
     node_t *n2 = lex();
-    if (!n2 || n2->tkn!=')') {
-      fprintf(stderr, "expected ')' in primary_expression\n");
-      exit(EXIT_FAILURE);
-    }
+    if (!n2 || n2->tkn!=')')
+      error("expected ')' in primary_expression");
     lexfree(n0);
     lexfree(n2);
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> '(' expression ')'\n");
     return n1;
   }
   unlex(n0);
   n0 = id_expression();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("primary-expression -> id-expression:\n");
     node_print(stdout, n0);
     return n0;
@@ -430,7 +601,7 @@ postfix_expression()
   if (!n0)
     return n0;
 
-  if (trace) {
+  if (parse_trace) {
     printf("postfix-expression:\n");
     node_print(stdout, n0);
   }
@@ -442,10 +613,8 @@ postfix_expression()
    
   if (n1->tkn=='.') {
     node_t *n2 = lex();
-    if (n2->tkn != TKN_IDENTIFIER) {
-      fprintf(stderr, "THE DOT FAILED\n");
-      exit(1);
-    }
+    if (!n2 || n2->tkn != TKN_IDENTIFIER)
+      error("expected identifier after '.' in postfix_expression");
     node_append(n0, n2);
     lexfree(n1);   
     n1 = lex();    
@@ -453,11 +622,7 @@ postfix_expression()
    
   if (n1->tkn=='(') {
     if (n0->tkn != TKN_IDENTIFIER /* && n0->tkn != TKN_CLASS_NAME */) 
-    {
-      fprintf(stderr, "postfix_expression: function call not implemented for:\n");
-      node_print(stderr, n0);
-      exit(1);
-    }
+      error("postfix_expression: function call not implemented for this expression");
      
     node_t *n2 = expression_list();
     if (!n2) {
@@ -482,7 +647,7 @@ postfix_expression()
       if (!n4 || n4->tkn!=TKN_IDENTIFIER)
         error("illegal here-document limiter");
       while(true) {
-        int c = fgetc(lex_in);
+        int c = lex_getc();
         if (c==EOF)
           error("unexpected end of here-document\n");
         if (c=='\n')
@@ -492,7 +657,7 @@ postfix_expression()
       char *str = (char*)malloc(16);
       size_t capacity=16, size=0;
       while(true) {
-        int c = fgetc(lex_in);
+        int c = lex_getc();
         if (c==EOF)
           error("unexpected end of here-document\n");
         if (c==n4->text[p]) {
@@ -510,7 +675,8 @@ postfix_expression()
       }
       str[size-p]=0;
       node_t *arg = node_new(TKN_STRING);
-      arg->text = str;
+      node_set_text(arg, str);
+      free(str);
       node_append(n2, arg);
       lexfree(n4);
     } else {
@@ -558,10 +724,8 @@ expression_list()
     lexfree(n2);
 
     n1 = assignment_expression();
-    if (!n1) {
-      fprintf(stderr, "expected assignment_expression after ',' in expression_list\n");
-      exit(EXIT_FAILURE);
-    }
+    if (!n1)
+      error("expected assignment_expression after ',' in expression_list");
     node_append(n0, n1);
   }
   return 0;
@@ -622,6 +786,12 @@ unary_expression()
      }
   }
 
+  // only sizeof is followed by ( type-id ), don't read further for the
+  // others: the token after the end of a declaration may not be there yet
+  if (n0->tkn != TKN_SIZEOF) {
+    unlex(n0);
+    return 0;
+  }
   node_t *n1 = lex();
   if (!n1 || n1->tkn!='(') {
     unlex(n1);
@@ -839,17 +1009,17 @@ additive_expression()
     node_t *n2 = additive_expression();
     if (!n2) {
       unlex(n1);
-      if (trace)
+      if (parse_trace)
         printf("additive_expression -> multiplicative_expression\n");
       return n0;
     }
     node_append(n1, n0);
     node_append(n1, n2);
-    if (trace)
+    if (parse_trace)
       printf("additive_expression -> multiplicative_expression '+' additive_expression\n");
     return n1;
   }
-  if (trace)
+  if (parse_trace)
     printf("additive_expression -> multiplicative_expression\n");
   unlex(n1);
   return n0;
@@ -1134,7 +1304,7 @@ conditional_expression()
   node_append(n1, n2);
   lexfree(n3);
   node_append(n1, n4);
-  if (trace)
+  if (parse_trace)
     printf("conditional-expression -> logical-or-expression ? expression : assignment-expression\n");
   return n1;
   
@@ -1145,7 +1315,7 @@ l2:
 l1:
   unlex(n1);
 l0:
-  if (trace)
+  if (parse_trace)
     printf("conditional-expression -> logical-or-expression\n");
   return n0;
 }
@@ -1162,7 +1332,7 @@ assignment_expression()
   node_t *n0;
   n0 = conditional_expression();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("assignment_expression -> conditional_expression\n");
     return n0;
   }
@@ -1172,7 +1342,7 @@ assignment_expression()
     return 0;
   node_t *n1 = assignment_operator();
   if (!n1) {
-    if (trace)
+    if (parse_trace)
       printf("assignment_expression -> logical_or_expression\n");
     return n0;
   }
@@ -1180,13 +1350,13 @@ assignment_expression()
   node_t *n2 = assignment_expression();
   if (!n2) {
     unlex(n1);
-    if (trace)
+    if (parse_trace)
       printf("assignment_expression -> logical_or_expression\n");
     return n0;
   }
   node_append(n1, n0);
   node_append(n1, n2);
-  if (trace)
+  if (parse_trace)
     printf("assignment_expression -> logical_or_expression assignment_operator assignment_expression\n");
   return n1;
 }
@@ -1280,49 +1450,49 @@ statement()
 
   n0 = labeled_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> labeled-statement\n");
     return n0;
   }
 
   n0 = expression_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> expression-statement\n");
     return n0;
   }
 
   n0 = compound_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> compound-statement\n");
     return n0;
   }
 
   n0 = selection_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> selection-statement\n");
     return n0;
   }
 
   n0 = iteration_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> iteration-statement\n");
     return n0;
   }
 
   n0 = jump_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> jump-statement\n");
     return n0;
   }
   
   n0 = declaration_statement();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("statement -> declaration-statement\n");
     return n0;
   }
@@ -1426,16 +1596,15 @@ compound_statement()
    
   node_t *n2 = lex();
   if (!n2 || n2->tkn != '}') {
-    fprintf(stderr, "compound_statement: expected statement or a closing '}'\n");
-    if (n1) {
+    if (parse_trace && n1) {
       fprintf(stderr, "after:\n");
       node_print0(stderr, n1, 1);
     }
-    if (n2) {
+    if (parse_trace && n2) {
       fprintf(stderr, "but got:\n");
       node_print0(stderr, n2, 1);
     }
-    exit(1);
+    error("compound_statement: expected statement or a closing '}'");
   }
   lexfree(n0);
   lexfree(n2);
@@ -1479,7 +1648,8 @@ selection_statement()
 {
   node_t *n0 = lex();
   if (n0->tkn == TKN_IF) {
-    printf("selection_statement: if ...\n");
+    if (parse_trace)
+      printf("selection_statement: if ...\n");
     node_t *n1 = lex();
     if (!n1 || n1->tkn!='(')
       error("expected '(' after if");
@@ -1497,8 +1667,10 @@ selection_statement()
       error("expected statement after if(...)");
     node_t *n5 = lex(), *n6;
 
-    printf("check for else\n");
-    printf("%c\n", n5->tkn);
+    if (parse_trace) {
+      printf("check for else\n");
+      printf("%c\n", n5->tkn);
+    }
 
     if (n5->tkn == TKN_ELSE) {
       n6 = statement();
@@ -1536,7 +1708,7 @@ condition()
 {
   node_t *n0 = expression();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("condition -> expression\n");
     return n0;
   }
@@ -1690,7 +1862,7 @@ jump_statement()
   }
   if (n1)
     node_append(n0, n1);
-  free(n2);
+  lexfree(n2);
   return n0;
 }
 
@@ -1703,7 +1875,7 @@ declaration_statement()
 {
   node_t *n0 = block_declaration();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("declaration-statement -> block-declaration\n");
     return n0;
   }
@@ -1724,14 +1896,20 @@ declaration-seq:
 node_t*
 declaration_seq()
 {
-  node_t *seq = 0;
+  node_t *seq = 0, *last = 0;
   while(true) {
     node_t *decl = declaration();
     if (!decl)
       return seq;
-    if (!seq)
+    if (!seq) {
       seq = node_new(TKN_DECLARATION_SEQ);
-    node_append(seq, decl);
+      seq->down = decl;
+    } else {
+      last->next = decl;
+    }
+    // keep the end, node_append would walk the whole sequence
+    for(last = decl; last->next; last = last->next)
+      ;
   }
 }
 
@@ -1769,7 +1947,7 @@ block_declaration()
 {
   node_t *n0 = simple_declaration();
   if (n0) {
-    if (trace)
+    if (parse_trace)
       printf("block_declaration -> simple_declaration\n");
   }
   return n0;
@@ -1817,7 +1995,7 @@ node_print(stdout, n2);
       n0->tkn=TKN_CLASS_NAME;
     }
 */
-    if (trace)
+    if (parse_trace)
       printf("simple-declaration -> decl-specifier-seq init-declarator-list\n");
     node_t *nx;
     nx = node_new(TKN_DECL_SPECIFIER_SEQ);
@@ -1831,11 +2009,11 @@ node_print(stdout, n2);
   }
   lexfree(n2);
   if (n0) {
-     if (trace)
+     if (parse_trace)
        printf("simple-declaration -> decl-specifier-seq\n");
     return n0;
   }
-  if (trace)
+  if (parse_trace)
     printf("simple-declaration -> init-declarator-list\n");
   return n1;
 }
@@ -2221,11 +2399,11 @@ type_id()
     return 0;
   node_t *n1 = abstract_declarator();
   if (!n1) {
-    if (trace)
+    if (parse_trace)
       printf("typeid -> type-specifier-seq");
     return n0;
   }
-  if (trace)
+  if (parse_trace)
     printf("typeid -> type-specifier-seq abstract-declarator");
   node_append(n0, n1);
   return n0;
@@ -2321,7 +2499,7 @@ parameter_declaration_clause() {
   if (n1 && n1->tkn == ',') {
     node_t *n2 = lex();
     if (n2 && n2->tkn == TKN_ELLIPSIS) {
-      free(n1);
+      lexfree(n1);
       node_append(list, n2);
       return list;
     }
@@ -2354,7 +2532,7 @@ parameter_declaration_list() {
       unlex(n1);
       return list;
     }
-    free(n1);
+    lexfree(n1);
   }
 }
 
@@ -2386,7 +2564,7 @@ parameter_declaration() {
   if (n2 || n2->tkn == '=') {
     node_t *n3 = assignment_expression();
     if (n3) {
-      free(n2);
+      lexfree(n2);
       node_append(n0, n3);
     } else {
       unlex(n2);
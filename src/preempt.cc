@@ -0,0 +1,42 @@
+#include "runtime.hh"
+
+using namespace std;
+
+ExecutionContext::Preemptible::Preemptible(const ExecutionContext &parent, node_t *call):
+  context(parent), call(call)
+{
+  machine.preemptible = true;
+  machine.frames.push_back(&frame);
+  context.fuel = 0;
+  context.push(machine, call);
+}
+
+ExecutionContext::Preemptible::~Preemptible()
+{
+  node_free(call);
+}
+
+bool
+ExecutionContext::Preemptible::run(long budget, chrono::steady_clock::time_point deadline)
+{
+  if (finished)
+    return true;
+  machine.budget = budget;
+  machine.deadline = deadline;
+  value = context.run(machine);
+  finished = !machine.suspended;
+  return finished;
+}
+
+unique_ptr<ExecutionContext::Preemptible>
+ExecutionContext::prepare(const char *name, const vector<node_t*> &args)
+{
+  follow();
+  node_t *call = node_new(TKN_FUNCTION_CALL);
+  node_append(call, node_new_txt(TKN_IDENTIFIER, name));
+  node_t *list = node_new(TKN_EXPRESSION_LIST);
+  node_append(call, list);
+  for(auto arg: args)
+    node_append(list, node_copy(arg));
+  return unique_ptr<Preemptible>(new Preemptible(*this, call));
+}
@@ -0,0 +1,573 @@
+#include "runtime.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+using namespace std;
+
+Program::Program()
+{
+  add_passes();
+}
+
+Program::Program(const Program &other):
+  sources(other.sources), functions(other.functions),
+  native_functions(other.native_functions), async_functions(other.async_functions),
+  specializations(other.specializations), callers(other.callers), arenas(other.arenas), budget(other.budget),
+  inlined(other.inlined), load_fuel(other.load_fuel), evaluated(other.evaluated)
+{
+  // the passes of 'other' work on 'other'
+  add_passes();
+  optimizer.add_statistics(other.optimizer);
+}
+
+void
+Program::add_passes()
+{
+  optimizer.add("inline", [this](node_t *function) {
+    return inline_calls(function->down->next->next);
+  });
+  optimizer.add("evaluate", [this](node_t *function) {
+    return evaluate_calls(function->down->next->next);
+  });
+}
+
+// names of all functions called within 'n'
+static void
+callees(node_t *n, set<string> &out)
+{
+  for(node_t *p = n->down; p; p=p->next) {
+    if (p->tkn == TKN_FUNCTION_CALL)
+      out.insert(p->down->text);
+    callees(p, out);
+  }
+}
+
+shared_ptr<node_t>
+Program::owned(node_t *function)
+{
+  // nodes of an arena go with it, which is kept while they are used
+  if (node_arena) {
+    assert(node_arena == arena.get());
+    shared_ptr<NodeArena> kept = arena;
+    return shared_ptr<node_t>(function, [kept](node_t*) {});
+  }
+  return shared_ptr<node_t>(function, [](node_t *n) {
+    // possibly replaced while compiling into an arena
+    NodeArena::Use heap(nullptr);
+    node_free(n);
+  });
+}
+
+// make 'function' the source of its name, keeping track of who calls whom
+void
+Program::define(node_t *function)
+{
+  node_t *&source = sources[function->text];
+  if (source) {
+    set<string> called;
+    callees(source, called);
+    for(auto &name: called)
+      callers[name].erase(function->text);
+  }
+  source = function;
+  if (node_arena)
+    arenas[function->text] = arena;
+  else
+    arenas.erase(function->text);
+  set<string> called;
+  callees(function, called);
+  for(auto &name: called)
+    callers[name].insert(function->text);
+}
+
+void
+Program::insert(node_t *node) {
+  assert(node->tkn == TKN_DECLARATION_SEQ);
+  set<string> dirty;
+  for (node_t *p = node->down; p; p=p->next) {
+    assert(p->tkn == TKN_FUNCTION);
+    define(p);
+    dirty.insert(p->text);
+  }
+  compile(dirty);
+}
+
+vector<string>
+Program::insert(const vector<string> &texts)
+{
+  vector<string> errors(texts.size());
+  // the parsed and the optimized functions keep the arena while any
+  // version of the program uses them
+  arena = make_shared<NodeArena>();
+  NodeArena::Use use(arena.get());
+  node_t *seq = node_new(TKN_DECLARATION_SEQ);
+  node_t **last = &seq->down;
+  for(size_t i = 0; i < texts.size(); ++i) {
+    node_t *root;
+    try {
+      root = parse(texts[i].data(), texts[i].data() + texts[i].size());
+    }
+    catch(syntax_error &e) {
+      errors[i] = e.what();
+      continue;
+    }
+    if (!root || !root->down)
+      continue;
+    node_t *p = root->down;
+    for(; p && p->tkn == TKN_FUNCTION; p=p->next)
+      ;
+    if (p) {
+      errors[i] = "only functions can be inserted";
+      continue;
+    }
+    *last = root->down;
+    while(*last)
+      last = &(*last)->next;
+  }
+  insert(seq);
+  arena.reset();
+  return errors;
+}
+
+set<string>
+Program::reload(node_t *node)
+{
+  set<string> dirty;
+  if (!node)
+    return dirty;
+  assert(node->tkn == TKN_DECLARATION_SEQ);
+  set<string> kept;
+  for (node_t *p = node->down; p; p=p->next) {
+    assert(p->tkn == TKN_FUNCTION);
+    kept.insert(p->text);
+    auto f = sources.find(p->text);
+    if (f != sources.end() && node_equal(f->second, p))
+      continue;
+    define(p);
+    dirty.insert(p->text);
+  }
+
+  // functions no longer there go, their callers are compiled again
+  set<string> removed;
+  for(auto &f: sources) {
+    if (kept.find(f.first) == kept.end())
+      removed.insert(f.first);
+  }
+  for(auto &name: removed) {
+    set<string> called;
+    callees(sources[name], called);
+    for(auto &callee: called)
+      callers[callee].erase(name);
+    sources.erase(name);
+    functions.erase(name);
+    arenas.erase(name);
+  }
+  for(auto p = specializations.begin(); p != specializations.end(); ) {
+    if (removed.find(p->second) != removed.end()) {
+      functions.erase(p->first);
+      p = specializations.erase(p);
+    } else {
+      ++p;
+    }
+  }
+  for(auto &name: removed) {
+    for(auto &caller: callers[name])
+      dirty.insert(caller);
+  }
+  compile(dirty);
+  dirty.insert(removed.begin(), removed.end());
+  return dirty;
+}
+
+// optimize 'dirty' and the functions calling them again, adding those
+void
+Program::compile(set<string> &dirty)
+{
+  // callers may have inlined the previous definition of a function
+  vector<string> todo(dirty.begin(), dirty.end());
+  while(!todo.empty()) {
+    auto called = callers.find(todo.back());
+    todo.pop_back();
+    if (called == callers.end())
+      continue;
+    for(auto &name: called->second) {
+      if (dirty.insert(name).second)
+        todo.push_back(name);
+    }
+  }
+
+  // all functions must be callable before any is evaluated at load time
+  // specializations of redefined functions are created again on demand
+  for(auto p = specializations.begin(); p != specializations.end(); ) {
+    if (dirty.find(p->second) != dirty.end()) {
+      functions.erase(p->first);
+      p = specializations.erase(p);
+    } else {
+      ++p;
+    }
+  }
+
+  for(auto &name: dirty)
+    functions[name] = owned(node_copy(sources[name]));
+  for(auto &name: dirty)
+    optimizer.run(functions[name].get());
+}
+
+void
+Program::dump(FILE *out)
+{
+  for(auto &f: functions)
+    node_print(out, f.second.get());
+  optimizer.print_timing(out);
+  fprintf(out, "inlined %u calls\n", inlined);
+  fprintf(out, "evaluated %u calls at load time\n", evaluated);
+}
+
+// size of 'n' and its children, but not its siblings; nodes in 'seen'
+// are shared with trees counted before
+static size_t
+node_bytes(node_t *n, set<node_t*> *seen = nullptr)
+{
+  if (seen && !seen->insert(n).second)
+    return 0;
+  size_t size = sizeof(node_t) + (n->text ? strlen(n->text) + 1 : 0);
+  for(node_t *p = n->down; p; p=p->next)
+    size += node_bytes(p, seen);
+  return size;
+}
+
+size_t
+Program::memory() const
+{
+  size_t size = 0;
+  // sources may have been parsed into a NodeTable
+  set<node_t*> seen;
+  for(auto &f: sources)
+    size += node_bytes(f.second, &seen);
+  for(auto &f: functions)
+    size += node_bytes(f.second.get());
+  return size;
+}
+
+int
+Program::arity(const string &name) const
+{
+  auto f = functions.find(name);
+  if (f == functions.end())
+    return -1;
+  int count = 0;
+  for(node_t *p = f->second->down->next->down; p; p=p->next)
+    ++count;
+  return count;
+}
+
+void
+Program::native(const string name, std::function<node_t*(node_t*)> cb) {
+  native_functions[name] = cb;
+}
+
+void
+Program::native_async(const string name, std::function<void(node_t*, std::function<void(node_t*)>)> cb) {
+  async_functions[name] = cb;
+}
+
+
+// true when 'name' can reach itself through the call graph
+bool
+Program::recursive(const string &name)
+{
+  set<string> seen, todo;
+  callees(sources[name], todo);
+  while(!todo.empty()) {
+    string callee = *todo.begin();
+    todo.erase(todo.begin());
+    if (callee == name)
+      return true;
+    if (!seen.insert(callee).second)
+      continue;
+    auto f = sources.find(callee);
+    if (f != sources.end())
+      callees(f->second, todo);
+  }
+  return false;
+}
+
+static unsigned
+node_size(node_t *n)
+{
+  unsigned size = 1;
+  for(node_t *p = n->down; p; p=p->next)
+    size += node_size(p);
+  return size;
+}
+
+static unsigned
+uses(node_t *n, const char *name)
+{
+  if (n->tkn == TKN_IDENTIFIER)
+    return strcmp(n->text, name) == 0 ? 1 : 0;
+  unsigned count = 0;
+  node_t *p = n->down;
+  if (n->tkn == TKN_FUNCTION_CALL)
+    p = p->next;
+  for(; p; p=p->next)
+    count += uses(p, name);
+  return count;
+}
+
+// true when all identifiers within 'n' are keys of 'args'
+static bool
+only_uses(node_t *n, map<string, node_t*> &args)
+{
+  if (n->tkn == TKN_IDENTIFIER)
+    return args.find(n->text) != args.end();
+  node_t *p = n->down;
+  if (n->tkn == TKN_FUNCTION_CALL)
+    p = p->next;
+  for(; p; p=p->next) {
+    if (!only_uses(p, args))
+      return false;
+  }
+  return true;
+}
+
+// replace identifiers naming parameters with their arguments
+static void
+substitute(node_t *n, map<string, node_t*> &args)
+{
+  if (n->tkn == TKN_IDENTIFIER) {
+    auto a = args.find(n->text);
+    if (a == args.end())
+      return;
+    node_t *next = n->next;
+    node_t *arg = node_copy(a->second);
+    node_set_text(n, nullptr);
+    *n = *arg;
+    n->next = next;
+    node_dispose(arg);
+    return;
+  }
+  node_t *p = n->down;
+  if (n->tkn == TKN_FUNCTION_CALL)
+    p = p->next;
+  for(; p; p=p->next)
+    substitute(p, args);
+}
+
+// replace calls to small, non-recursive functions of the form
+// 'return expression;' by the expression
+bool
+Program::inline_calls(node_t *n)
+{
+  bool changed = false;
+  for(node_t *p = n->down; p; p=p->next)
+    changed |= inline_calls(p);
+
+  if (n->tkn != TKN_FUNCTION_CALL)
+    return changed;
+  const char *name = n->down->text;
+  if (native_functions.find(name) != native_functions.end())
+    return changed;
+  auto f = sources.find(name);
+  if (f == sources.end())
+    return changed;
+
+  node_t *body = f->second->down->next->next;
+  if (!body->down || body->down->next || body->down->tkn != TKN_RETURN || !body->down->down)
+    return changed;
+  node_t *expression = body->down->down;
+  if (node_size(expression) > budget || recursive(name))
+    return changed;
+
+  map<string, node_t*> args;
+  node_t *e = n->down->next->down;
+  for(node_t *p = f->second->down->next->down; p; p=p->next, e=e->next) {
+    if (p->tkn != TKN_DECL_SPECIFIER_SEQ || !e)
+      return changed;
+    node_t *id = p->down->next;
+    if (!id || id->tkn != TKN_IDENTIFIER)
+      return changed;
+    // each argument must be evaluated exactly as often as before
+    if (!node_is_pure(e) || (e->down && uses(expression, id->text) > 1))
+      return changed;
+    args[id->text] = e;
+  }
+  if (e)
+    return changed;
+
+  // globals would be looked up in the caller's frame instead
+  if (!only_uses(expression, args))
+    return changed;
+
+  node_t *copy = node_copy(expression);
+  substitute(copy, args);
+  node_t *next = n->next;
+  node_free(n->down);
+  *n = *copy;
+  n->next = next;
+  node_dispose(copy);
+  ++inlined;
+  return true;
+}
+
+// true when calling 'name' depends on nothing but its arguments
+bool
+Program::pure(const string &name, set<string> &visiting)
+{
+  if (native_functions.find(name) != native_functions.end())
+    return false;
+  auto f = sources.find(name);
+  if (f == sources.end())
+    return false;
+  if (!visiting.insert(name).second)
+    return true;
+  set<string> params;
+  for(node_t *p = f->second->down->next->down; p; p=p->next) {
+    if (p->tkn != TKN_DECL_SPECIFIER_SEQ || !p->down->next || p->down->next->tkn != TKN_IDENTIFIER)
+      return false;
+    params.insert(p->down->next->text);
+  }
+  return pure(f->second->down->next->next, params, visiting);
+}
+
+bool
+Program::pure(node_t *n, set<string> &params, set<string> &visiting)
+{
+  node_t *p = n->down;
+  switch(n->tkn) {
+    case TKN_VALUE_INT:
+    case TKN_VALUE_DOUBLE:
+      return true;
+    case TKN_IDENTIFIER:
+      return params.find(n->text) != params.end();
+    case TKN_FUNCTION_CALL:
+      if (!pure(n->down->text, visiting))
+        return false;
+      p = n->down->next->down;
+      break;
+    case TKN_STATEMENT_SEQ:
+    case TKN_EXPRESSION:
+    case TKN_RETURN:
+    case TKN_IF:
+    case TKN_TRUE:
+    case TKN_FALSE:
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case TKN_SHL:
+    case TKN_SHR:
+    case '<':
+    case '>':
+    case TKN_LE:
+    case TKN_GE:
+    case TKN_EQ:
+    case TKN_NEQ:
+      break;
+    default:
+      return false;
+  }
+  for(; p; p=p->next) {
+    if (!pure(p, params, visiting))
+      return false;
+  }
+  return true;
+}
+
+// replace calls to pure functions with constant arguments by their result
+bool
+Program::evaluate_calls(node_t *n)
+{
+  bool changed = false;
+  for(node_t *p = n->down; p; p=p->next)
+    changed |= evaluate_calls(p);
+
+  if (n->tkn != TKN_FUNCTION_CALL)
+    return changed;
+  for(node_t *e = n->down->next->down; e; e=e->next) {
+    if (e->tkn != TKN_VALUE_INT && e->tkn != TKN_VALUE_DOUBLE)
+      return changed;
+  }
+  set<string> visiting;
+  if (!pure(n->down->text, visiting))
+    return changed;
+
+  // the program isn't shared yet, the context must not own it
+  ExecutionContext context(shared_ptr<const Program>(this, [](const Program*) {}));
+  ExecutionContext::frame_t frame;
+  node_t *result = 0;
+  context.fuel = load_fuel;
+  try {
+    result = context.eval(n, frame);
+  }
+  catch(ExecutionContext::out_of_fuel&) {
+    // might not terminate, leave it to run time
+  }
+  catch(ExecutionContext::stack_overflow&) {
+    // too deep to evaluate here
+  }
+  catch(ExecutionContext::script_error&) {
+    // fails, but maybe on a branch that is never taken
+  }
+  catch(out_of_memory&) {
+    // too big to evaluate here
+  }
+  if (!result)
+    return changed;
+
+  result = node_copy(result);
+  node_t *next = n->next;
+  node_free(n->down);
+  *n = *result;
+  n->next = next;
+  node_dispose(result);
+  ++evaluated;
+  return true;
+}
+
+// create a copy of 'name' with some parameters replaced by constants
+string
+Program::specialize(const string &name, const map<unsigned, int> &constants)
+{
+  string key = name + "[";
+  for(auto &c: constants) {
+    if (key.back() != '[')
+      key += ",";
+    key += to_string(c.first) + "=" + to_string(c.second);
+  }
+  key += "]";
+  if (specializations.find(key) != specializations.end())
+    return key;
+
+  auto f = sources.find(name);
+  if (f == sources.end())
+    throw ExecutionContext::script_error("unknown function '" + name + "'");
+  node_t *function = node_copy(f->second);
+  node_set_text(function, key.c_str());
+
+  map<string, node_t*> args;
+  unsigned index = 0;
+  for(node_t **link = &function->down->next->down; *link; ++index) {
+    node_t *p = *link;
+    auto c = constants.find(index);
+    if (c == constants.end()) {
+      link = &p->next;
+      continue;
+    }
+    args[p->down->next->text] = node_new_value(c->second);
+    *link = p->next;
+    p->next = 0;
+    node_free(p);
+  }
+  substitute(function->down->next->next, args);
+  for(auto &a: args)
+    node_free(a.second);
+
+  optimizer.run(function);
+  functions[key] = owned(function);
+  specializations[key] = name;
+  return key;
+}
@@ -1,92 +1,799 @@
 #include "runtime.hh"
 
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
 using namespace std;
 
+ExecutionContext::ExecutionContext(shared_ptr<const Program> program):
+  program(program)
+{
+}
+
+ExecutionContext::ExecutionContext(shared_ptr<const Versions> followed):
+  followed(followed), version(followed->number())
+{
+  program = followed->latest();
+}
+
+ExecutionContext::ExecutionContext(const ExecutionContext &parent):
+  program(parent.program), max_calls(parent.max_calls), max_steps(parent.max_steps),
+  pool(parent.pool), pool_size(parent.pool_size)
+{
+}
+
+ExecutionContext::~ExecutionContext()
+{
+  // tasks not joined share the pool, which must not be freed by a worker
+  for(auto &task: tasks)
+    pool->wait([&task] { return task.second->done.load(); });
+  memory_released(MEMORY_NATIVE, scratch.size() * sizeof(node_t));
+}
+
+ExecutionContext::memory_t
+ExecutionContext::memory() const
+{
+  memory_t m;
+  m.values = heap.bytes();
+  m.native = scratch.size() * sizeof(node_t);
+  for(auto machine: active)
+    m.stack += machine->bytes();
+  if (idle)
+    m.stack += idle->bytes();
+  return m;
+}
+
 void
-Runtime::insert(node_t *node) {
-  assert(node->tkn == TKN_DECLARATION_SEQ);
-  for (node_t *p = node->down; p; p=p->next) {
-    assert(p->tkn == TKN_FUNCTION);
-    functions[p->text] = p;
+ExecutionContext::check_memory() const
+{
+  if (!max_memory)
+    return;
+  size_t used = memory().total();
+  if (used > max_memory)
+    throw out_of_memory("memory limit of " + to_string(max_memory) + " bytes exceeded (" + to_string(used) + ")");
+}
+
+Runtime::Runtime():
+  Runtime(make_shared<Program>())
+{
+}
+
+Runtime::Runtime(shared_ptr<Program> code):
+  ExecutionContext(code), code(code), published(make_shared<Versions>(code))
+{
+  followed = published;
+  version = published->number();
+}
+
+shared_ptr<Program>
+Runtime::next()
+{
+  // only referenced by 'code', this context and the published version,
+  // which nobody else follows: no other thread can get to it
+  if (active.empty() && code.use_count() == 3 && published.use_count() == 2)
+    return code;
+  return make_shared<Program>(*code);
+}
+
+void
+Runtime::publish(shared_ptr<Program> next)
+{
+  if (next == code)
+    return;
+  code = next;
+  published->publish(next);
+  follow();
+}
+
+void
+Runtime::insert(node_t *n)
+{
+  auto next = this->next();
+  next->insert(n);
+  publish(next);
+}
+
+vector<string>
+Runtime::insert(const vector<string> &texts)
+{
+  auto next = this->next();
+  vector<string> errors = next->insert(texts);
+  publish(next);
+  return errors;
+}
+
+void
+Runtime::insert(FILE *in, const function<void(node_t*)> &inserted)
+{
+  parse_stream(in, [&](node_t *declaration) {
+    node_t *seq = node_new(TKN_DECLARATION_SEQ);
+    seq->down = declaration;
+    insert(seq);
+    // the program keeps the declaration
+    seq->down = nullptr;
+    node_free(seq);
+    inserted(declaration);
+  });
+}
+
+set<string>
+Runtime::reload(node_t *root)
+{
+  auto next = this->next();
+  set<string> compiled = next->reload(root);
+  publish(next);
+  return compiled;
+}
+
+void
+Runtime::native(const string name, function<node_t*(node_t*)> cb)
+{
+  auto next = this->next();
+  next->native(name, cb);
+  publish(next);
+}
+
+void
+Runtime::native_async(const string name, function<void(node_t*, function<void(node_t*)>)> cb)
+{
+  auto next = this->next();
+  next->native_async(name, cb);
+  publish(next);
+}
+
+string
+Runtime::specialize(const string &name, const map<unsigned, int> &constants)
+{
+  auto next = this->next();
+  string key = next->specialize(name, constants);
+  publish(next);
+  return key;
+}
+
+void
+ExecutionContext::follow()
+{
+  if (!followed || !active.empty())
+    return;
+  unsigned latest = followed->number();
+  if (latest == version)
+    return;
+  program = followed->latest();
+  version = latest;
+}
+
+ExecutionContext::machine_t::~machine_t()
+{
+  for(size_t i=1; i<frames.size(); ++i)
+    delete frames[i];
+  for(auto frame: spare)
+    delete frame;
+}
+
+size_t
+ExecutionContext::machine_t::bytes() const
+{
+  size_t size = sizeof(machine_t) + steps.capacity() * sizeof(step_t) +
+    values.capacity() * sizeof(node_t*) + frames.capacity() * sizeof(frame_t*) +
+    calls.capacity() * sizeof(size_t) + spare.capacity() * sizeof(frame_t*);
+  for(size_t i=1; i<frames.size(); ++i)
+    size += sizeof(frame_t) + frames[i]->variables.capacity() * sizeof(frames[i]->variables[0]);
+  for(auto frame: spare)
+    size += sizeof(frame_t) + frame->variables.capacity() * sizeof(frame->variables[0]);
+  return size;
+}
+
+void
+ExecutionContext::machine_t::reset()
+{
+  steps.clear();
+  values.clear();
+  for(size_t i=1; i<frames.size(); ++i) {
+    frames[i]->variables.clear();
+    frames[i]->returned = false;
+    spare.push_back(frames[i]);
   }
+  frames.clear();
+  calls.clear();
+  suspended = false;
+}
+
+node_t*
+ExecutionContext::eval(node_t *node, frame_t &frame) {
+  follow();
+  // nested evals from builtins need a machine of their own
+  unique_ptr<machine_t> m(idle ? idle.release() : new machine_t);
+  struct recycle {
+    unique_ptr<machine_t> &m, &idle;
+    ~recycle() {
+      // after a failed call, give back what it grew to
+      if (idle || uncaught_exception())
+        return;
+      m->reset();
+      idle = move(m);
+    }
+  } guard { m, idle };
+  m->frames.push_back(&frame);
+  push(*m, node);
+  return run(*m);
+}
+
+node_t*
+ExecutionContext::call0(node_t *statement)
+{
+  struct release {
+    node_t *statement;
+    ~release() {
+      statement->down->text = nullptr; // not owned
+      node_free(statement);
+    }
+  } guard { statement };
+  frame_t frame;
+  node_t *result = eval(statement, frame);
+  // the result might be one of the arguments
+  for(node_t *arg = statement->down->next->down; arg; arg=arg->next) {
+    if (result == arg) {
+      returned = *arg;
+      returned.next = nullptr;
+      result = &returned;
+    }
+  }
+  return result;
+}
+
+node_t*
+ExecutionContext::call(const char *name, const vector<node_t*> &args)
+{
+  node_t *statement = node_new(TKN_FUNCTION_CALL);
+  node_t *identifier = node_new(TKN_IDENTIFIER);
+  identifier->text = (char*)name;
+  node_append(statement, identifier);
+  node_t *exprlist = node_new(TKN_EXPRESSION_LIST);
+  node_append(statement, exprlist);
+  for(auto arg: args)
+    node_append(exprlist, node_copy(arg));
+  return call0(statement);
+}
+
+ExecutionContext::Call::Call(ExecutionContext &context, const char *name, size_t arity):
+  context(context)
+{
+  call = node_new(TKN_FUNCTION_CALL);
+  node_append(call, node_new_txt(TKN_IDENTIFIER, name));
+  node_t *list = node_new(TKN_EXPRESSION_LIST);
+  node_append(call, list);
+  for(size_t i=0; i<arity; ++i) {
+    slots.push_back(node_new_value(0));
+    node_append(list, slots.back());
+  }
+}
+
+ExecutionContext::Call::~Call()
+{
+  for(auto slot: slots)
+    slot->text = nullptr;
+  node_free(call);
+}
+
+node_t*
+ExecutionContext::Call::run()
+{
+  frame_t frame;
+  node_t *result = context.eval(call, frame);
+  for(auto slot: slots) {
+    if (result == slot) {
+      context.returned = *slot;
+      context.returned.next = nullptr;
+      result = &context.returned;
+    }
+  }
+  return result;
 }
 
 void
-Runtime::native(const string name, std::function<node_t*(node_t*)> cb) {
-  native_functions[name] = cb;
+ExecutionContext::push(machine_t &m, node_t *node)
+{
+  if (m.steps.size() >= max_steps)
+    throw stack_overflow("expression nesting exceeds the depth limit");
+  bool grows = m.steps.size() == m.steps.capacity();
+  m.steps.push_back({ node, node->down, m.values.size(), 0 });
+  if (grows)
+    check_memory();
 }
 
 node_t*
-Runtime::eval(node_t *node) {
-  switch(node->tkn) {
-    case TKN_FUNCTION_CALL: {
-      string identifier = node->down->text;
-      
-      auto native_fun = native_functions.find(identifier);
-      if (native_fun != native_functions.end()) {
-        return native_fun->second(node->down->next->down);
-      }
-    
-      auto fun = functions.find(identifier);
-      if (fun == functions.end()) {
-        fprintf(stderr, "unknown function '%s'\n", node->down->text);
-        exit(1);
-      }
-      auto returnType = fun->second->down;
-      auto parameterList = fun->second->down->next->down;
-      auto body = fun->second->down->next->next;
-      
-      auto expressionList = node->down->next->down;
-//      printf("call with\n");
-//      node_print(stdout, expressionList);
-//      printf("call to\n");
-//      node_print(stdout, parameterList);
-      for(auto p=parameterList, e=expressionList; p; p=p->next, e=e->next) {
-        auto id = p->down->next;
-        auto value = e;
-        variables[id->text] = value;
-//        printf("%s = %i\n", id->text, value->value.i);
-      }
-      
-      // take parameter list
-      
-      return eval(body);
-      // return type
-      // parameter list
-      // body
-    } break;
-    case TKN_STATEMENT_SEQ:
-      for(node_t *p = node->down; p; p=p->next) {
-        auto result = eval(p);
-        if (p->tkn == TKN_RETURN)
-          return result;
-      }
-      break;
-    case TKN_EXPRESSION:
-      return eval(node->down);
-    case TKN_RETURN:
-      return eval(node->down);
-    case TKN_VALUE_INT:
-    case TKN_VALUE_DOUBLE:
-      return node;
-    case TKN_IDENTIFIER:
-      return variables[node->text];
-    case '+': {
-      auto n0 = eval(node->down);
-      auto n1 = eval(node->down->next);
-      if (n0->tkn == TKN_VALUE_INT && n1->tkn == TKN_VALUE_INT) {
-        node_t *n = node_new(TKN_VALUE_INT);
-        n->value.i = n0->value.i + n1->value.i;
-        return n; // FIXME: memory leak
+ExecutionContext::value(int i)
+{
+  node_t *n = heap.allocate();
+  if (!n) {
+    collect();
+    n = heap.allocate();
+  }
+  n->tkn = TKN_VALUE_INT;
+  n->text = nullptr;
+  n->value.i = i;
+  n->next = n->down = nullptr;
+  return n;
+}
+
+void
+ExecutionContext::collect()
+{
+  heap.collect([this](const Heap::visit_t &visit) {
+    for(auto m: active) {
+      for(auto &v: m->values)
+        visit(v);
+      for(auto frame: m->frames) {
+        for(auto &variable: frame->variables)
+          visit(variable.second);
       }
-      fprintf(stderr, "no code to evaluate + node\n");
-      node_print(stderr, node);
-      exit(1);
-    } break;
-    default:
-      fprintf(stderr, "no code to evaluate node\n");
-      node_print(stderr, node);
-      exit(1);
+    }
+    for(auto &handle: handles)
+      visit(handle);
+  });
+  check_memory();
+}
+
+// 'fuel' ran out: continue with the next slice of the budget, or stop
+// the machine when there is none
+bool
+ExecutionContext::refuel(machine_t &m)
+{
+  ++fuel;
+  if (!m.preemptible)
+    throw out_of_fuel();
+  if (m.budget == 0 || chrono::steady_clock::now() >= m.deadline) {
+    m.suspended = true;
+    return false;
+  }
+  // the deadline is only checked once per slice
+  long slice = min(m.budget, 4096L);
+  m.budget -= slice;
+  fuel += slice - 1;
+  return true;
+}
+
+// why 'tkn' can't be applied to 'a' and 'b'
+static string
+arith_error(int tkn, const node_t *a, const node_t *b)
+{
+  if (!a || !b || a->tkn != TKN_VALUE_INT || b->tkn != TKN_VALUE_INT)
+    return "arithmetic on values other than ints";
+  if (tkn == TKN_SHL || tkn == TKN_SHR)
+    return "shift count out of range";
+  return b->value.i == 0 ? "division by zero" : "division overflow";
+}
+
+// why unary 'tkn' can't be applied to its operand
+static string
+unary_error(int tkn)
+{
+  if (tkn != '-' && tkn != '+')
+    return string("no code to evaluate unary '") + (char)tkn + "'";
+  return "arithmetic on values other than ints";
+}
+
+// true when the value of the call on top of the stack is returned as is
+bool
+ExecutionContext::tail_position(const machine_t &m)
+{
+  for(size_t i = m.steps.size() - 1; i-- > 0; ) {
+    if (m.steps[i].node->tkn == TKN_RETURN)
+      return true;
+    if (m.steps[i].node->tkn != TKN_EXPRESSION)
+      return false;
+  }
+  return false;
+}
+
+node_t*
+ExecutionContext::run(machine_t &m)
+{
+  static const struct {
+    const char *name;
+    builtin_t run;
+  } builtins[] = {
+    { "parallel_for", &ExecutionContext::parallel_for },
+    { "spawn", &ExecutionContext::spawn },
+    { "join", &ExecutionContext::join },
+    { "post", &ExecutionContext::post }
+  };
+
+  // the values and frames of 'm' are roots while it runs
+  struct activation {
+    vector<machine_t*> &active;
+    activation(vector<machine_t*> &active, machine_t *m): active(active) { active.push_back(m); }
+    ~activation() { active.pop_back(); }
+  } running(active, &m);
+  // a failed outermost call leaves nothing behind for the next one
+  struct cleanup {
+    ExecutionContext &context;
+    ~cleanup() {
+      if (!uncaught_exception() || context.active.size() != 1)
+        return;
+      context.heap.reset();
+      context.scratch_top = 0;
+    }
+  } failed { *this };
+
+  m.suspended = false;
+  while(!m.steps.empty()) {
+    size_t top = m.steps.size() - 1;
+    step_t &s = m.steps[top];
+    node_t *node = s.node;
+    frame_t &frame = *m.frames.back();
+    switch(node->tkn) {
+      case TKN_FUNCTION_CALL: {
+        if (s.phase == 0) {
+          builtin_t builtin = nullptr;
+          for(auto &b: builtins) {
+            if (strcmp(b.name, node->down->text) == 0)
+              builtin = b.run;
+          }
+          if (builtin) {
+            m.steps.pop_back();
+            m.values.push_back((this->*builtin)(node->down->next->down, frame));
+            break;
+          }
+          s.cursor = node->down->next->down;
+          s.phase = 1;
+        }
+        if (s.phase == 1) {
+          // evaluate the arguments onto the value stack
+          if (s.cursor) {
+            node_t *e = s.cursor;
+            s.cursor = e->next;
+            push(m, e);
+            break;
+          }
+          string identifier = node->down->text;
+          size_t base = s.base;
+
+          auto native_fun = program->native_functions.find(identifier);
+          if (native_fun != program->native_functions.end()) {
+            // the arguments are only valid during the call
+            size_t mark = scratch_top;
+            node_t *args = nullptr, **tail = &args;
+            for(size_t i=base; i<m.values.size(); ++i) {
+              if (scratch_top == scratch.size()) {
+                scratch.emplace_back();
+                memory_allocated(MEMORY_NATIVE, sizeof(node_t));
+                check_memory();
+              }
+              node_t *arg = &scratch[scratch_top++];
+              if (m.values[i]) {
+                *arg = *m.values[i];
+              }
+              else {
+                memset(arg, 0, sizeof(node_t));
+                arg->tkn = TKN_NONE;
+              }
+              arg->next = arg->down = nullptr;
+              *tail = arg;
+              tail = &arg->next;
+            }
+            m.values.resize(base);
+            m.steps.pop_back();
+            node_t *result = native_fun->second(args);
+            for(node_t *arg = args; arg; arg=arg->next) {
+              if (result == arg) {
+                node_t *copy = heap.allocate();
+                if (!copy) {
+                  collect();
+                  copy = heap.allocate();
+                }
+                *copy = *arg;
+                copy->next = nullptr;
+                result = copy;
+                break;
+              }
+            }
+            scratch_top = mark;
+            m.values.push_back(result);
+            break;
+          }
+
+          auto async_fun = program->async_functions.find(identifier);
+          if (async_fun != program->async_functions.end()) {
+            if (!m.async)
+              throw script_error("async function '" + identifier + "' needs call_async");
+            node_t *args = node_new(TKN_EXPRESSION_LIST);
+            for(size_t i=base; i<m.values.size(); ++i)
+              node_append(args, m.values[i] ? node_copy(m.values[i]) : node_new(TKN_NONE));
+            m.values.resize(base);
+            // the result is pushed by whoever resumes
+            s.phase = 3;
+            m.pending = identifier;
+            m.pending_args = args;
+            m.suspended = true;
+            return nullptr;
+          }
+
+          auto fun = program->functions.find(identifier);
+          if (fun == program->functions.end())
+            throw script_error("unknown function '" + identifier + "'");
+          // preempted before anything changed, the call is retried on resume
+          if (--fuel < 0 && !refuel(m))
+            return nullptr;
+          auto parameterList = fun->second->down->next->down;
+          auto body = fun->second->down->next->next;
+
+          frame_t *callee;
+          bool fresh = m.spare.empty();
+          if (fresh) {
+            callee = new frame_t;
+          }
+          else {
+            callee = m.spare.back();
+            m.spare.pop_back();
+            callee->variables.clear();
+          }
+          size_t i = base;
+          for(auto p=parameterList; p; p=p->next, ++i)
+            callee->variables.push_back({ p->down->next->text, m.values[i] });
+          m.values.resize(base);
+
+          if (!m.calls.empty() && tail_position(m)) {
+            // 'return f(...)': replace the caller's frame instead of adding one
+            size_t call = m.calls.back();
+            swap(*m.frames.back(), *callee);
+            m.spare.push_back(callee);
+            m.spare.back()->variables.clear();
+            m.steps.resize(call + 1);
+            m.values.resize(m.steps[call].base);
+            push(m, body);
+            break;
+          }
+          if (m.calls.size() >= max_calls) {
+            m.spare.push_back(callee);
+            throw stack_overflow("calls nested too deep in '" + identifier + "'");
+          }
+          m.frames.push_back(callee);
+          m.calls.push_back(top);
+          s.phase = 2;
+          push(m, body);
+          if (fresh)
+            check_memory();
+          break;
+        }
+        if (s.phase == 2) {
+          // the body returned, its result is on top
+          m.frames.back()->variables.clear();
+          m.frames.back()->returned = false;
+          m.spare.push_back(m.frames.back());
+          m.frames.pop_back();
+          m.calls.pop_back();
+        }
+        m.steps.pop_back();
+      } break;
+      case TKN_STATEMENT_SEQ:
+        // drop the value of the previous statement
+        m.values.resize(s.base);
+        if (s.cursor) {
+          node_t *p = s.cursor;
+          s.cursor = p->next;
+          push(m, p);
+          break;
+        }
+        m.steps.pop_back();
+        m.values.push_back(nullptr);
+        break;
+      case TKN_WHILE: {
+        auto condition = node->down;
+        if (s.phase == 2) {
+          m.values.resize(s.base);
+          if (--fuel < 0 && !refuel(m))
+            return nullptr;
+          s.phase = 0;
+        }
+        if (s.phase == 0) {
+          s.phase = 1;
+          push(m, condition);
+          break;
+        }
+        bool taken = node_is_true(m.values.back());
+        m.values.pop_back();
+        if (taken) {
+          s.phase = 2;
+          push(m, condition->next);
+          break;
+        }
+        m.steps.pop_back();
+        m.values.push_back(nullptr);
+      } break;
+      case TKN_DO: {
+        auto body = node->down;
+        if (s.phase == 1) {
+          m.values.resize(s.base);
+          s.phase = 2;
+          push(m, body->next);
+          break;
+        }
+        if (s.phase == 2) {
+          bool taken = node_is_true(m.values.back());
+          m.values.pop_back();
+          if (!taken) {
+            m.steps.pop_back();
+            m.values.push_back(nullptr);
+            break;
+          }
+          s.phase = 3;
+        }
+        if (s.phase == 3) {
+          if (--fuel < 0 && !refuel(m))
+            return nullptr;
+        }
+        s.phase = 1;
+        push(m, body);
+      } break;
+      case TKN_FOR: {
+        // for(init; condition; step) body
+        auto init = node->down;
+        auto condition = init->next;
+        auto step = condition->next;
+        auto body = step->next;
+        if (s.phase == 0) {
+          s.phase = 1;
+          if (init->tkn != TKN_NONE) {
+            push(m, init);
+            break;
+          }
+        }
+        if (s.phase == 1) {
+          m.values.resize(s.base);
+          s.phase = 2;
+          if (condition->tkn != TKN_NONE) {
+            push(m, condition);
+            break;
+          }
+        }
+        if (s.phase == 2) {
+          bool taken = condition->tkn == TKN_NONE || node_is_true(m.values.back());
+          m.values.resize(s.base);
+          if (!taken) {
+            m.steps.pop_back();
+            m.values.push_back(nullptr);
+            break;
+          }
+          s.phase = 3;
+          push(m, body);
+          break;
+        }
+        if (s.phase == 3) {
+          m.values.resize(s.base);
+          s.phase = 4;
+          if (step->tkn != TKN_NONE) {
+            push(m, step);
+            break;
+          }
+        }
+        m.values.resize(s.base);
+        if (--fuel < 0 && !refuel(m))
+          return nullptr;
+        s.phase = 1;
+      } break;
+      case TKN_EXPRESSION:
+        if (s.phase == 0) {
+          s.phase = 1;
+          push(m, node->down);
+          break;
+        }
+        m.steps.pop_back();
+        break;
+      case TKN_RETURN: {
+        if (s.phase == 0 && node->down) {
+          s.phase = 1;
+          push(m, node->down);
+          break;
+        }
+        node_t *result = node->down ? m.values.back() : nullptr;
+        if (m.calls.empty()) {
+          // returning from the frame eval was called with
+          frame.returned = true;
+          m.steps.clear();
+          m.values.clear();
+          m.values.push_back(result);
+          break;
+        }
+        // unwind to the call, which then pops the frame
+        size_t call = m.calls.back();
+        m.steps.resize(call + 1);
+        m.values.resize(m.steps[call].base);
+        m.values.push_back(result);
+      } break;
+      case TKN_IF: {
+        auto condition = node->down;
+        if (s.phase == 0) {
+          s.phase = 1;
+          push(m, condition);
+          break;
+        }
+        if (s.phase == 1) {
+          bool taken = node_is_true(m.values.back());
+          m.values.pop_back();
+          node_t *branch = taken ? condition->next : condition->next->next;
+          if (branch) {
+            s.phase = 2;
+            push(m, branch);
+            break;
+          }
+          m.values.push_back(nullptr);
+        }
+        m.steps.pop_back();
+      } break;
+      case TKN_VALUE_INT:
+      case TKN_VALUE_DOUBLE:
+      case TKN_STRING:
+      case TKN_TRUE:
+      case TKN_FALSE:
+        m.steps.pop_back();
+        m.values.push_back(node);
+        break;
+      case TKN_IDENTIFIER:
+        m.steps.pop_back();
+        m.values.push_back(frame.lookup(node->text));
+        break;
+      case '+':
+      case '-':
+      case '*':
+      case '/':
+      case '%':
+      case TKN_SHL:
+      case TKN_SHR:
+      case '<':
+      case '>':
+      case TKN_LE:
+      case TKN_GE:
+      case TKN_EQ:
+      case TKN_NEQ: {
+        // unary '-', '+' and '*' have a single operand
+        bool unary = !node->down->next;
+        if (s.phase < (unary ? 1 : 2)) {
+          push(m, s.phase++ == 0 ? node->down : node->down->next);
+          break;
+        }
+        if (unary) {
+          auto n0 = m.values.back();
+          m.values.pop_back();
+          m.steps.pop_back();
+          int result;
+          if (n0 && n0->tkn == TKN_VALUE_INT && node_unary(node->tkn, n0->value.i, &result)) {
+            m.values.push_back(value(result));
+            break;
+          }
+          throw script_error(unary_error(node->tkn));
+        }
+        auto n1 = m.values.back();
+        m.values.pop_back();
+        auto n0 = m.values.back();
+        m.values.pop_back();
+        m.steps.pop_back();
+        int result;
+        if ( n0 && n1 && n0->tkn == TKN_VALUE_INT && n1->tkn == TKN_VALUE_INT &&
+             node_arith(node->tkn, n0->value.i, n1->value.i, &result) )
+        {
+          m.values.push_back(value(result));
+          break;
+        }
+        throw script_error(arith_error(node->tkn, n0, n1));
+      } break;
+      default:
+        throw script_error("no code to evaluate token " + to_string(node->tkn));
+    }
+  }
+  node_t *result = m.values.empty() ? nullptr : m.values.back();
+  if (active.size() == 1 && result) {
+    // the call is over and only its result escapes: keep a copy and
+    // reuse the whole nursery for the next one
+    returned = *result;
+    returned.next = returned.down = nullptr;
+    result = &returned;
+  }
+  if (active.size() == 1) {
+    heap.reset();
+    scratch_top = 0;
   }
-  return nullptr;
+  return result;
 }
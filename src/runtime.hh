@@ -1,41 +1,390 @@
+#ifndef RUNTIME_HH_
+#define RUNTIME_HH_
+
 #include "lex.hh"
+#include "optimizer.hh"
+#include "threadpool.hh"
+#include "heap.hh"
+#include "memory.hh"
+#include "arena.hh"
 
 #include <string>
+#include <string.h>
 #include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <vector>
+#include <memory>
 #include <functional>
+#include <stdexcept>
+#include <exception>
+#include <chrono>
+#include <climits>
+#include <atomic>
+#include <initializer_list>
 
-class Runtime {
-    std::map<std::string, node_t*> functions;
+// The loaded and optimized functions. Once a Program is shared between
+// ExecutionContexts it is only read, which needs no locking.
+class Program {
+    friend class ExecutionContext;
+    std::map<std::string, node_t*> sources; // functions as parsed
+    // functions as optimized, shared with the other versions of the program
+    std::map<std::string, std::shared_ptr<node_t>> functions;
     std::map<std::string, std::function<node_t*(node_t*)>> native_functions;
-    std::map<std::string, node_t*> variables;
+    std::map<std::string, std::function<void(node_t*, std::function<void(node_t*)>)>> async_functions;
+    std::map<std::string, std::string> specializations; // name -> source name
+    std::map<std::string, std::set<std::string>> callers; // of each function, as parsed
+    // of the sources inserted in bulk; optimized functions keep theirs too
+    std::map<std::string, std::shared_ptr<NodeArena>> arenas;
+    std::shared_ptr<NodeArena> arena; // in use while inserting in bulk
+    PassManager optimizer;
+    unsigned budget = 16;
+    unsigned inlined = 0;
+    long load_fuel = 1000;
+    unsigned evaluated = 0;
   public:
+    Program();
+    // a new version sharing the functions of 'other'
+    Program(const Program &other);
+    Program& operator=(const Program&) = delete;
     void insert(node_t*);
+    // parse all of 'texts' into one arena and insert their functions at
+    // once, which takes less memory than one at a time for many small
+    // sources; returns the error of each text, empty for those inserted
+    std::vector<std::string> insert(const std::vector<std::string> &texts);
+    // insert the functions of 'root' that differ from the loaded ones and
+    // remove those missing from it; returns the functions compiled again,
+    // with their callers, and those removed
+    std::set<std::string> reload(node_t *root);
+    // bytes of the parsed and the optimized functions
+    size_t memory() const;
     void native(const std::string name, std::function<node_t*(node_t*)> cb);
+    // a native that hands its result to 'complete' later, possibly on
+    // another thread; only scripts started with call_async may call it.
+    // 'args' are valid until 'complete' is called
+    void native_async(const std::string name, std::function<void(node_t *args, std::function<void(node_t*)> complete)> cb);
+    void dump(FILE *out);
+    void inline_budget(unsigned nodes) { budget = nodes; }
+    unsigned inlined_calls() const { return inlined; }
+    void evaluation_fuel(long calls) { load_fuel = calls; }
+    unsigned evaluated_calls() const { return evaluated; }
+    std::string specialize(const std::string &name, const std::map<unsigned, int> &constants);
+    // parameters of the script function 'name', -1 if there is none
+    int arity(const std::string &name) const;
+
+  protected:
+    void add_passes();
+    void define(node_t *function);
+    std::shared_ptr<node_t> owned(node_t *function);
+    void compile(std::set<std::string> &dirty);
+    bool recursive(const std::string &name);
+    bool inline_calls(node_t *n);
+    bool pure(const std::string &name, std::set<std::string> &visiting);
+    bool pure(node_t *n, std::set<std::string> &params, std::set<std::string> &visiting);
+    bool evaluate_calls(node_t *n);
+};
+
+// The published version of a Program, replaced as a whole by Runtime::reload.
+// Contexts following it switch to the latest version between calls, so a
+// call runs on one version from start to end; versions are freed when
+// no context uses them anymore.
+class Versions {
+    std::shared_ptr<const Program> program;
+    std::atomic<unsigned> count;
+  public:
+    Versions(std::shared_ptr<const Program> program): program(program), count(0) {}
+    // changes with every version published
+    unsigned number() const { return count.load(std::memory_order_acquire); }
+    std::shared_ptr<const Program> latest() const { return std::atomic_load(&program); }
+    void publish(std::shared_ptr<const Program> next) {
+      std::atomic_store(&program, next);
+      count.fetch_add(1, std::memory_order_release);
+    }
+};
+
+// The state of executing a Program on one thread.
+class ExecutionContext {
+    friend class Program;
+    friend class Actor;
+  protected:
+    struct frame_t {
+      // few enough for a linear search; the names belong to the function
+      std::vector<std::pair<const char*, node_t*>> variables;
+      bool returned = false;
+      node_t* lookup(const char *name) const {
+        for(auto &variable: variables) {
+          if (strcmp(variable.first, name) == 0)
+            return variable.second;
+        }
+        return nullptr;
+      }
+    };
+    typedef node_t* (ExecutionContext::*builtin_t)(node_t *args, frame_t &frame);
+    struct task_t {
+      std::atomic<bool> done;
+      std::unique_ptr<ExecutionContext> context; // until it is done
+      bool returned = false; // with 'result'
+      node_t result;
+      std::exception_ptr failure;
+    };
+    // thrown by eval when 'fuel' is exhausted
+    struct out_of_fuel {};
+
+    // eval keeps its own stack instead of recursing so that it can stop
+    // at an async native and continue once the result is there
+    struct step_t {
+      node_t *node;
+      node_t *cursor; // next child to evaluate
+      size_t base; // height of 'values' when the step started
+      int phase;
+    };
+    struct machine_t {
+      std::vector<step_t> steps;
+      std::vector<node_t*> values;
+      std::vector<frame_t*> frames; // frames[0] is the caller's
+      std::vector<size_t> calls; // the step of the call of each further frame
+      std::vector<frame_t*> spare; // frames to reuse
+      bool async = false; // may suspend
+      bool suspended = false;
+      std::string pending; // async native to call before resuming
+      node_t *pending_args = nullptr;
+      bool preemptible = false; // stops instead of throwing out_of_fuel
+      long budget = 0; // fuel left after the current slice
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+      ~machine_t();
+      size_t bytes() const;
+      // empty the stacks but keep their memory for the next eval
+      void reset();
+    };
+    struct invocation_t;
+
+    std::shared_ptr<const Program> program;
+    std::shared_ptr<const Versions> followed;
+    unsigned version = 0;
+    Heap heap; // not shared with child contexts
+    std::vector<machine_t*> active; // machines running on this context
+    std::list<node_t*> handles;
+    std::unique_ptr<machine_t> idle; // reused by eval
+    node_t returned; // copy of the result of the last outermost eval
+    std::deque<node_t> scratch; // arguments of native calls, used like a stack
+    size_t scratch_top = 0;
+    // function entries and loop iterations left before refuel is asked
+    long fuel = LONG_MAX;
+    size_t max_calls = 100000;
+    size_t max_steps = 1000000;
+    size_t max_memory = 0;
+    std::shared_ptr<ThreadPool> pool; // shared with the contexts of tasks
+    unsigned pool_size = 0;
+    std::mutex tasks_lock;
+    std::map<int, std::shared_ptr<task_t>> tasks;
+    int next_task = 0;
+  public:
+    class Preemptible;
+    class Handle;
+    class Call;
+
+    // thrown when a script nests calls or expressions deeper than allowed;
+    // the context can be used again afterwards
+    struct stack_overflow: std::runtime_error {
+      stack_overflow(const std::string &what): std::runtime_error(what) {}
+    };
+    // thrown when a script can't go on, as after calling an unknown
+    // function or dividing by zero; the context can be used again afterwards
+    struct script_error: std::runtime_error {
+      script_error(const std::string &what): std::runtime_error(what) {}
+    };
+
+    ExecutionContext(std::shared_ptr<const Program> program);
+    // runs the latest of 'versions'
+    ExecutionContext(std::shared_ptr<const Versions> followed);
+    // runs the version 'parent' runs
+    ExecutionContext(const ExecutionContext &parent);
+    ~ExecutionContext();
+
+    struct memory_t {
+      size_t ast = 0; // the program, filled in by Runtime
+      size_t values = 0; // the heap
+      size_t native = 0; // arguments marshaled for natives
+      size_t stack = 0; // evaluation stacks and frames
+      size_t total() const { return ast + values + native + stack; }
+    };
+    // bytes used by this context
+    memory_t memory() const;
+    // calls fail with out_of_memory once the context would need more than
+    // 'bytes' for values, native arguments and stacks; 0 for no limit
+    void memory_limit(size_t bytes) { max_memory = bytes; }
+
+    // collections of the values created by scripts
+    const Heap::stats_t& gc_stats() const { return heap.stats(); }
+
+    // nesting allowed for script calls (not counting tail calls) and for
+    // evaluation steps within them
+    void depth_limit(size_t calls, size_t steps) { max_calls = calls; max_steps = steps; }
 
+    // number of threads used by parallel_for and spawn, 0 for one per core
+    void threads(unsigned size);
+
+    // call name(args...), suspending while async natives are pending, and
+    // pass the result to 'done' on the thread that completed the last one
+    void call_async(const char *name, const std::vector<node_t*> &args, std::function<void(node_t*)> done);
+
+    // prepare name(args...) to be run within budgets and deadlines
+    std::unique_ptr<Preemptible> prepare(const char *name, const std::vector<node_t*> &args);
+
+    // out[row] = name(columns[0][row], columns[1][row], ...); a native
+    // result other than one of its arguments is freed once read, and calls
+    // may nest less deep than with call
+    void call_batch(const char *name, size_t rows, std::initializer_list<const int*> columns, int *out);
+
+    // name(args...); the nodes in 'args' stay with the caller
+    node_t* call(const char *name, const std::vector<node_t*> &args);
+
+    // the result stays valid until the next call on this context, keep it
+    // in a Handle to use it longer
     template <typename... T>
     node_t* call(const char *name, T... t) {
       node_t *statement = node_new(TKN_FUNCTION_CALL);
-      
+
       node_t *identifier = node_new(TKN_IDENTIFIER);
       identifier->text = (char*)name;
       node_append(statement, identifier);
 
       node_t *exprlist = node_new(TKN_EXPRESSION_LIST);
       node_append(statement, exprlist);
-      
+
       return call0(statement, t...);
     }
-    
+
   protected:
-    node_t* call0(node_t *statement) {
-        return eval(statement);
-    }
- 
+    // switch to the latest version unless a call is running
+    void follow();
+    node_t* call0(node_t *statement);
+
     template <typename H, typename... T>
     node_t* call0(node_t *statement, H p, T... t) {
       node_append(statement->down->next, node_new_value(p));
       return call0(statement, t...);
     }
 
-    node_t* eval(node_t*);
+    node_t* eval(node_t*, frame_t &frame);
+    void push(machine_t &m, node_t *node);
+    static bool tail_position(const machine_t &m);
+    node_t* value(int i);
+    void collect();
+    void check_memory() const;
+    bool refuel(machine_t &m);
+    // returns the result, or nullptr when suspended
+    node_t* run(machine_t &m);
+
+    typedef std::map<std::string, const int*> batch_frame_t;
+    // 'depth' counts the calls nested on the C stack
+    void call_batch(node_t *function, batch_frame_t &frame, size_t rows, int *out, size_t depth);
+    void exec_batch(node_t *n, batch_frame_t &frame, std::vector<size_t> &rows, int *out, size_t depth);
+    std::vector<int> eval_batch(node_t *n, batch_frame_t &frame, const std::vector<size_t> &rows, size_t depth);
+
+    ThreadPool& workers();
+    node_t* invoke(const char *name, const std::vector<node_t*> &args);
+    node_t* parallel_for(node_t *args, frame_t &frame);
+    node_t* spawn(node_t *args, frame_t &frame);
+    node_t* join(node_t *args, frame_t &frame);
+    node_t* post(node_t *args, frame_t &frame);
+};
+
+// Keeps a copy of a value returned by a call alive and up to date while
+// the context's heap is collected.
+class ExecutionContext::Handle {
+    ExecutionContext &context;
+    std::list<node_t*>::iterator slot;
+  public:
+    Handle(ExecutionContext &context, node_t *value):
+      context(context), slot(context.handles.insert(context.handles.end(), context.heap.keep(value))) {}
+    ~Handle() { context.handles.erase(slot); }
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    node_t* get() const { return *slot; }
+    node_t* operator->() const { return *slot; }
+};
+
+// A call that stops once it has used up its budget of function entries
+// and loop iterations or passed its deadline. It can then be run again
+// with a new budget, or dropped to abort it.
+class ExecutionContext::Preemptible {
+    friend class ExecutionContext;
+    ExecutionContext context;
+    machine_t machine;
+    frame_t frame;
+    node_t *call;
+    node_t *value = nullptr;
+    bool finished = false;
+    Preemptible(const ExecutionContext &parent, node_t *call);
+  public:
+    ~Preemptible();
+    // true when the call finished, false when it was preempted
+    bool run(long budget, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    bool done() const { return finished; }
+    node_t* result() const { return value; }
 };
+
+// A call of a function built once and run for many arguments, which are
+// changed in place between runs. The text of string arguments belongs to
+// the caller.
+class ExecutionContext::Call {
+    ExecutionContext &context;
+    node_t *call;
+    std::vector<node_t*> slots;
+  public:
+    Call(ExecutionContext &context, const char *name, size_t arity);
+    ~Call();
+    Call(const Call&) = delete;
+    Call& operator=(const Call&) = delete;
+    // set its tkn and value, or text, before run()
+    node_t* arg(size_t i) { return slots[i]; }
+    // valid until the next call on the context
+    node_t* run();
+};
+
+// A Program together with a context executing it on the calling thread.
+class Runtime: public ExecutionContext {
+    std::shared_ptr<Program> code;
+    std::shared_ptr<Versions> published;
+    Runtime(std::shared_ptr<Program> code);
+    // the program to change: a copy once another context may run it
+    std::shared_ptr<Program> next();
+    void publish(std::shared_ptr<Program> next);
+  public:
+    Runtime();
+    // the program, to be executed by contexts on other threads
+    std::shared_ptr<const Program> share() const { return code; }
+    // the versions published, for contexts on other threads to follow
+    std::shared_ptr<const Versions> versions() const { return published; }
+
+    memory_t memory() const {
+      memory_t m = ExecutionContext::memory();
+      m.ast = code->memory();
+      return m;
+    }
+
+    // each change below publishes a new version of the program; while the
+    // program is shared that copies it, so many functions are better
+    // inserted at once than one at a time
+    void insert(node_t *n);
+    std::vector<std::string> insert(const std::vector<std::string> &texts);
+    // insert the functions of 'in' one at a time while it is read, passing
+    // each as parsed to 'inserted', when it can be called already
+    void insert(FILE *in, const std::function<void(node_t *function)> &inserted);
+    // publish a new version with the functions of 'root' that changed;
+    // calls already running finish on the version they started with
+    std::set<std::string> reload(node_t *root);
+    void native(const std::string name, std::function<node_t*(node_t*)> cb);
+    void native_async(const std::string name, std::function<void(node_t*, std::function<void(node_t*)>)> cb);
+    void dump(FILE *out) { code->dump(out); }
+    void inline_budget(unsigned nodes) { code->inline_budget(nodes); }
+    unsigned inlined_calls() const { return code->inlined_calls(); }
+    void evaluation_fuel(long calls) { code->evaluation_fuel(calls); }
+    unsigned evaluated_calls() const { return code->evaluated_calls(); }
+    std::string specialize(const std::string &name, const std::map<unsigned, int> &constants);
+    int arity(const std::string &name) const { return code->arity(name); }
+};
+
+#endif // #ifndef RUNTIME_HH_
@@ -0,0 +1,204 @@
+#include "scan.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+static inline bool
+is_space(unsigned char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool
+is_identifier(unsigned char c)
+{
+  return (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10 || c == '_';
+}
+
+static size_t
+spaces_scalar(const char *p, const char *end)
+{
+  const char *q = p;
+  while(q < end && is_space(*q))
+    ++q;
+  return q - p;
+}
+
+static size_t
+identifier_scalar(const char *p, const char *end)
+{
+  const char *q = p;
+  while(q < end && is_identifier(*q))
+    ++q;
+  return q - p;
+}
+
+static size_t
+until_scalar(const char *p, const char *end, char a, char b)
+{
+  const char *q = p;
+  while(q < end && *q != a && *q != b)
+    ++q;
+  return q - p;
+}
+
+#ifdef SCAN_X86
+
+// The vector versions compute a mask with a bit set for each byte that
+// ends the run and finish the last partial block with the scalar ones.
+
+#if defined(__SSE2__)
+
+static inline unsigned
+space_mask_sse2(__m128i x)
+{
+  // '\t'..'\r' are 9..13: x - 9 <= 4 unsigned
+  __m128i control = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+  __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+  __m128i space = _mm_or_si128(in_range, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+  return ~_mm_movemask_epi8(space) & 0xffff;
+}
+
+static inline unsigned
+identifier_mask_sse2(__m128i x)
+{
+  __m128i lower = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(lower, _mm_set1_epi8(25)), lower);
+  __m128i digit0 = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+  __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(digit0, _mm_set1_epi8(9)), digit0);
+  __m128i underscore = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+  return ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(letter, digit), underscore)) & 0xffff;
+}
+
+static size_t
+spaces_sse2(const char *p, const char *end)
+{
+  const char *q = p;
+  for(; end - q >= 16; q += 16) {
+    unsigned mask = space_mask_sse2(_mm_loadu_si128((const __m128i*)q));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + spaces_scalar(q, end);
+}
+
+static size_t
+identifier_sse2(const char *p, const char *end)
+{
+  const char *q = p;
+  for(; end - q >= 16; q += 16) {
+    unsigned mask = identifier_mask_sse2(_mm_loadu_si128((const __m128i*)q));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + identifier_scalar(q, end);
+}
+
+static size_t
+until_sse2(const char *p, const char *end, char a, char b)
+{
+  __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  const char *q = p;
+  for(; end - q >= 16; q += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)q);
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + until_scalar(q, end, a, b);
+}
+
+#endif // defined(__SSE2__)
+
+__attribute__((target("avx2"))) static inline unsigned
+space_mask_avx2(__m256i x)
+{
+  __m256i control = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+  __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+  __m256i space = _mm256_or_si256(in_range, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+  return ~(unsigned)_mm256_movemask_epi8(space);
+}
+
+__attribute__((target("avx2"))) static inline unsigned
+identifier_mask_avx2(__m256i x)
+{
+  __m256i lower = _mm256_sub_epi8(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  __m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(lower, _mm256_set1_epi8(25)), lower);
+  __m256i digit0 = _mm256_sub_epi8(x, _mm256_set1_epi8('0'));
+  __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit0, _mm256_set1_epi8(9)), digit0);
+  __m256i underscore = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+  return ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(letter, digit), underscore));
+}
+
+__attribute__((target("avx2"))) static size_t
+spaces_avx2(const char *p, const char *end)
+{
+  const char *q = p;
+  for(; end - q >= 32; q += 32) {
+    unsigned mask = space_mask_avx2(_mm256_loadu_si256((const __m256i*)q));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + spaces_scalar(q, end);
+}
+
+__attribute__((target("avx2"))) static size_t
+identifier_avx2(const char *p, const char *end)
+{
+  const char *q = p;
+  for(; end - q >= 32; q += 32) {
+    unsigned mask = identifier_mask_avx2(_mm256_loadu_si256((const __m256i*)q));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + identifier_scalar(q, end);
+}
+
+__attribute__((target("avx2"))) static size_t
+until_avx2(const char *p, const char *end, char a, char b)
+{
+  __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+  const char *q = p;
+  for(; end - q >= 32; q += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)q);
+    unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)));
+    if (mask)
+      return q - p + __builtin_ctz(mask);
+  }
+  return q - p + until_scalar(q, end, a, b);
+}
+
+#endif // SCAN_X86
+
+scanner_t scanner = { spaces_scalar, identifier_scalar, until_scalar };
+// the best one by default
+static scan_level_e initial = scan_select(SCAN_AVX2);
+
+scan_level_e
+scan_select(scan_level_e level)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (level >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+    scanner = { spaces_avx2, identifier_avx2, until_avx2 };
+    return SCAN_AVX2;
+  }
+#if defined(__SSE2__)
+  if (level >= SCAN_SSE2) {
+    scanner = { spaces_sse2, identifier_sse2, until_sse2 };
+    return SCAN_SSE2;
+  }
+#endif
+#endif
+  scanner = { spaces_scalar, identifier_scalar, until_scalar };
+  return SCAN_SCALAR;
+}
+
+const char*
+scan_name(scan_level_e level)
+{
+  static const char *names[] = { "scalar", "sse2", "avx2" };
+  return names[level];
+}
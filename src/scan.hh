@@ -0,0 +1,26 @@
+#ifndef SCAN_HH_
+#define SCAN_HH_
+
+#include <stddef.h>
+
+// Runs of characters the lexer consumes without looking at each one,
+// using SSE2 or AVX2 when the CPU has them. Each function returns the
+// length of the run starting at 'p', at most end - p. Only ASCII counts
+// as space, letter or digit, as in the "C" locale the lexer assumes.
+struct scanner_t {
+  // ' ', '\t', '\n', '\v', '\f', '\r'
+  size_t (*spaces)(const char *p, const char *end);
+  // letters, digits and '_'
+  size_t (*identifier)(const char *p, const char *end);
+  // characters other than 'a' and 'b'
+  size_t (*until)(const char *p, const char *end, char a, char b);
+};
+
+enum scan_level_e { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+extern scanner_t scanner;
+// use the best scanner up to 'level' the CPU supports; returns which
+scan_level_e scan_select(scan_level_e level);
+const char* scan_name(scan_level_e level);
+
+#endif // #ifndef SCAN_HH_
@@ -0,0 +1,425 @@
+#include "server.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+
+using namespace std;
+
+// latencies kept for the percentiles
+static const size_t LATENCIES = 4096;
+// a longer request line closes the connection
+static const size_t MAX_LINE = 1 << 20;
+
+static void
+check(int result, const char *what)
+{
+  if (result < 0)
+    throw system_error(errno, generic_category(), what);
+}
+
+Server::program_t::~program_t()
+{
+  // the program keeps pointers into the tree
+  runtime.reset();
+  node_free(root);
+}
+
+Server::Server(const string &path):
+  path(path)
+{
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    throw system_error(ENAMETOOLONG, generic_category(), "socket path");
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  try {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path.c_str());
+    check(listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket");
+    check(bind(listener, (sockaddr*)&address, sizeof(address)), "bind");
+    check(listen(listener, SOMAXCONN), "listen");
+    check(loop = epoll_create1(EPOLL_CLOEXEC), "epoll_create1");
+    check(wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd");
+    for(int fd: { listener, wake }) {
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      check(epoll_ctl(loop, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
+    }
+  }
+  catch(...) {
+    close_all();
+    throw;
+  }
+}
+
+Server::~Server()
+{
+  close_all();
+}
+
+void
+Server::close_all()
+{
+  while(!connections.empty())
+    close_connection(connections.begin()->first);
+  if (listener >= 0) {
+    close(listener);
+    unlink(path.c_str());
+  }
+  if (loop >= 0)
+    close(loop);
+  if (wake >= 0)
+    close(wake);
+  listener = loop = wake = -1;
+}
+
+void
+Server::stop()
+{
+  uint64_t one = 1;
+  ssize_t written = write(wake, &one, sizeof(one));
+  (void)written;
+}
+
+void
+Server::run()
+{
+  while(true) {
+    epoll_event events[64];
+    int n = epoll_wait(loop, events, 64, -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    check(n, "epoll_wait");
+    for(int i=0; i<n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == wake) {
+        uint64_t count;
+        ssize_t got = read(wake, &count, sizeof(count));
+        (void)got;
+        return;
+      }
+      if (fd == listener) {
+        accept_all();
+        continue;
+      }
+      auto c = connections.find(fd);
+      if (c == connections.end())
+        continue;
+      if (events[i].events & EPOLLOUT) {
+        if (!send(c->second)) {
+          close_connection(fd);
+          continue;
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        receive(c->second);
+    }
+  }
+}
+
+void
+Server::accept_all()
+{
+  while(true) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return; // EAGAIN, or out of descriptors until some are closed
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(loop, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      continue;
+    }
+    connections[fd].fd = fd;
+  }
+}
+
+void
+Server::receive(connection_t &c)
+{
+  bool closed = false;
+  char buffer[16384];
+  while(true) {
+    ssize_t n = read(c.fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      c.in.append(buffer, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    closed = n == 0 || errno != EAGAIN;
+    break;
+  }
+
+  size_t start = 0, end;
+  while((end = c.in.find('\n', start)) != string::npos) {
+    c.out += handle(c.in.substr(start, end - start));
+    c.out += '\n';
+    start = end + 1;
+  }
+  c.in.erase(0, start);
+  if (!send(c) || closed || c.in.size() > MAX_LINE)
+    close_connection(c.fd);
+}
+
+// false when the connection failed
+bool
+Server::send(connection_t &c)
+{
+  size_t sent = 0;
+  while(sent < c.out.size()) {
+    ssize_t n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    return false;
+  }
+  c.out.erase(0, sent);
+  bool writable = !c.out.empty();
+  if (writable != c.writable) {
+    epoll_event event = {};
+    event.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.fd = c.fd;
+    if (epoll_ctl(loop, EPOLL_CTL_MOD, c.fd, &event) < 0)
+      return false;
+    c.writable = writable;
+  }
+  return true;
+}
+
+void
+Server::close_connection(int fd)
+{
+  epoll_ctl(loop, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  connections.erase(fd);
+}
+
+string
+Server::handle(const string &line)
+{
+  auto start = chrono::steady_clock::now();
+  string request = line;
+  if (!request.empty() && request.back() == '\r')
+    request.pop_back();
+  if (request == "stats")
+    return stats();
+
+  string reply;
+  if (request.compare(0, 5, "call ") == 0)
+    reply = call(request);
+  else
+    reply = "error unknown request";
+  long nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+  if (latencies.size() < LATENCIES)
+    latencies.push_back(nanoseconds);
+  else
+    latencies[requests % LATENCIES] = nanoseconds;
+  ++requests;
+  if (reply.compare(0, 6, "error ") == 0)
+    ++errors;
+  total += nanoseconds;
+  slowest = max(slowest, nanoseconds);
+
+  char time[32];
+  snprintf(time, sizeof(time), " %.1fus", nanoseconds / 1000.0);
+  return reply + time;
+}
+
+// 'file' as loaded before unless it changed; nullptr with 'error' when it
+// can't be read or parsed
+Server::program_t*
+Server::load(const string &file, string &error)
+{
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0) {
+    error = file + ": " + strerror(errno);
+    return nullptr;
+  }
+  auto &program = programs[file];
+  bool same_file = program && program->device == st.st_dev && program->inode == st.st_ino;
+  if (same_file && program->size == st.st_size &&
+      program->modified.tv_sec == st.st_mtim.tv_sec && program->modified.tv_nsec == st.st_mtim.tv_nsec) {
+    error = program->error;
+    return program->runtime ? program.get() : nullptr;
+  }
+
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = file + ": " + strerror(errno);
+    return nullptr;
+  }
+  string text;
+  char buffer[65536];
+  ssize_t n;
+  while((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+    if (n > 0)
+      text.append(buffer, n);
+  }
+  close(fd);
+  size_t hash = std::hash<string>()(text);
+
+  // touched but not changed
+  if (same_file && program->hash == hash) {
+    program->size = st.st_size;
+    program->modified = st.st_mtim;
+    error = program->error;
+    return program->runtime ? program.get() : nullptr;
+  }
+
+  unique_ptr<program_t> loaded(new program_t);
+  loaded->device = st.st_dev;
+  loaded->inode = st.st_ino;
+  loaded->size = st.st_size;
+  loaded->modified = st.st_mtim;
+  loaded->hash = hash;
+  try {
+    loaded->root = parse(text.data(), text.data() + text.size());
+    for(node_t *p = loaded->root ? loaded->root->down : nullptr; p; p=p->next) {
+      if (p->tkn != TKN_FUNCTION)
+        throw syntax_error("only functions can be declared");
+    }
+    loaded->runtime.reset(new Runtime);
+    if (loaded->root)
+      loaded->runtime->insert(loaded->root);
+  }
+  catch(exception &e) {
+    // not only parsing, compiling may fail as well
+    loaded->runtime.reset();
+    loaded->error = file + ": " + e.what();
+  }
+  ++loads;
+  program = move(loaded);
+  error = program->error;
+  return program->runtime ? program.get() : nullptr;
+}
+
+static void
+trim(string &s)
+{
+  size_t begin = s.find_first_not_of(" \t");
+  size_t end = s.find_last_not_of(" \t");
+  s = begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+}
+
+// "call <file> <function>(<arguments>)"
+string
+Server::call(const string &request)
+{
+  size_t begin = request.find_first_not_of(' ', 5);
+  size_t end = begin == string::npos ? string::npos : request.find(' ', begin);
+  size_t open = end == string::npos ? string::npos : request.find('(', end);
+  size_t close = open == string::npos ? string::npos : request.rfind(')');
+  if (close == string::npos || close < open)
+    return "error expected call <file> <function>(<arguments>)";
+  string file = request.substr(begin, end - begin);
+  string name = request.substr(end, open - end);
+  trim(name);
+
+  vector<node_t*> args;
+  struct release {
+    vector<node_t*> &args;
+    ~release() {
+      for(auto arg: args)
+        node_free(arg);
+    }
+  } guard { args };
+  string list = request.substr(open + 1, close - open - 1);
+  trim(list);
+  for(size_t p = 0; !list.empty() && p <= list.size(); ) {
+    size_t comma = min(list.find(',', p), list.size());
+    string arg = list.substr(p, comma - p);
+    trim(arg);
+    const char *text = arg.c_str();
+    char *rest;
+    errno = 0;
+    long i = strtol(text, &rest, 10);
+    if (rest == text || *rest == '.' || *rest == 'e' || *rest == 'E') {
+      double d = strtod(text, &rest);
+      args.push_back(node_new_value(d));
+    }
+    else {
+      if (errno || i < INT_MIN || i > INT_MAX)
+        return "error argument out of range: " + arg;
+      args.push_back(node_new_value((int)i));
+    }
+    if (arg.empty() || *rest)
+      return "error bad argument: '" + arg + "'";
+    p = comma + 1;
+  }
+
+  string error;
+  program_t *program = load(file, error);
+  if (!program)
+    return "error " + error;
+  int arity = program->runtime->arity(name);
+  if (arity < 0)
+    return "error unknown function '" + name + "'";
+  if ((size_t)arity != args.size())
+    return "error " + name + " takes " + to_string(arity) + " arguments";
+
+  // a call that doesn't end mustn't keep the other connections waiting
+  unique_ptr<ExecutionContext::Preemptible> running;
+  node_t *result;
+  try {
+    running = program->runtime->prepare(name.c_str(), args);
+    if (!running->run(budget, chrono::steady_clock::now() + timeout))
+      return "error " + name + " exceeded its budget";
+    result = running->result();
+  }
+  catch(exception &e) {
+    return string("error ") + e.what();
+  }
+  if (!result || result->tkn == TKN_NONE)
+    return "ok";
+  char value[64];
+  if (result->tkn == TKN_VALUE_INT)
+    snprintf(value, sizeof(value), "%i", result->value.i);
+  else
+  if (result->tkn == TKN_VALUE_DOUBLE)
+    snprintf(value, sizeof(value), "%.17g", result->value.d);
+  else
+  if (result->tkn == TKN_TRUE || result->tkn == TKN_FALSE)
+    snprintf(value, sizeof(value), "%s", result->tkn == TKN_TRUE ? "true" : "false");
+  else
+    return string("ok ") + (result->text ? result->text : "?");
+  return string("ok ") + value;
+}
+
+string
+Server::stats() const
+{
+  vector<long> sorted(latencies);
+  sort(sorted.begin(), sorted.end());
+  auto percentile = [&sorted](double p) {
+    return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))] / 1000.0;
+  };
+  char line[256];
+  snprintf(line, sizeof(line), "requests %zu errors %zu loads %zu mean %.1fus p50 %.1fus p99 %.1fus max %.1fus",
+           requests, errors, loads, requests ? total / 1000.0 / requests : 0.0,
+           percentile(0.5), percentile(0.99), slowest / 1000.0);
+  return line;
+}
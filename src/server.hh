@@ -0,0 +1,83 @@
+#ifndef SERVER_HH_
+#define SERVER_HH_
+
+#include "runtime.hh"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <climits>
+
+// Serves script calls to local clients over a UNIX socket, keeping each
+// script loaded until its file changes. Requests and replies are lines:
+//
+//   call /path/script.cs function(1, 2.5)  ->  ok 42 3.1us
+//                                          ->  error <message> 0.8us
+//   stats                                  ->  requests 10 errors 0 ...
+//
+// The time in a reply is how long the request took in the server. A call
+// that fails, or runs past its budget, fails only its own request.
+class Server {
+    struct program_t {
+      // the file it was loaded from
+      dev_t device = 0;
+      ino_t inode = 0;
+      off_t size = 0;
+      struct timespec modified = {};
+      size_t hash = 0;
+      node_t *root = nullptr;
+      std::unique_ptr<Runtime> runtime;
+      std::string error; // when it didn't parse
+      ~program_t();
+    };
+    struct connection_t {
+      int fd;
+      std::string in, out;
+      bool writable = false; // waiting for room to send 'out'
+    };
+
+    std::string path;
+    int listener = -1;
+    int loop = -1;
+    int wake = -1;
+    std::map<std::string, std::unique_ptr<program_t>> programs;
+    std::map<int, connection_t> connections;
+    // latencies of the last requests, in nanoseconds
+    std::vector<long> latencies;
+    size_t requests = 0, errors = 0, loads = 0;
+    long total = 0, slowest = 0;
+    // function entries and loop iterations, and time, each call may take
+    long budget = LONG_MAX;
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(1000);
+
+  public:
+    // listens on 'path', replacing a socket left there; throws
+    // std::system_error
+    Server(const std::string &path);
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // handle requests until stop() is called
+    void run();
+    // may be called from any thread and from signal handlers
+    void stop();
+    void limit(long calls, std::chrono::milliseconds time) { budget = calls; timeout = time; }
+    // the reply to one request line
+    std::string handle(const std::string &request);
+
+  private:
+    void close_all();
+    program_t* load(const std::string &file, std::string &error);
+    std::string call(const std::string &request);
+    std::string stats() const;
+    void accept_all();
+    void receive(connection_t &c);
+    bool send(connection_t &c);
+    void close_connection(int fd);
+};
+
+#endif // #ifndef SERVER_HH_
@@ -0,0 +1,133 @@
+#include "threadpool.hh"
+
+using namespace std;
+
+// the pool and index of the worker running on this thread
+static thread_local ThreadPool *current_pool = 0;
+static thread_local unsigned current = 0;
+
+ThreadPool::ThreadPool(unsigned size):
+  next(0), stop(false), queued(0), completed(0)
+{
+  if (size == 0)
+    size = 1;
+  for(unsigned i=0; i<size; ++i)
+    workers.push_back(new worker_t);
+  for(unsigned i=0; i<size; ++i)
+    threads.push_back(thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> guard(idle_lock);
+    stop = true;
+  }
+  idle.notify_all();
+  for(auto &t: threads)
+    t.join();
+  for(auto w: workers)
+    delete w;
+}
+
+void
+ThreadPool::submit(function<void()> task)
+{
+  unsigned index = current_pool == this ? current : next++ % workers.size();
+  {
+    lock_guard<mutex> guard(idle_lock);
+    ++queued;
+  }
+  {
+    lock_guard<mutex> guard(workers[index]->lock);
+    workers[index]->tasks.push_back(task);
+  }
+  idle.notify_one();
+  progress.notify_all();
+}
+
+bool
+ThreadPool::take(unsigned index, function<void()> &task)
+{
+  // own tasks last in first out, stolen ones first in first out
+  worker_t *own = workers[index];
+  {
+    lock_guard<mutex> guard(own->lock);
+    if (!own->tasks.empty()) {
+      task = move(own->tasks.back());
+      own->tasks.pop_back();
+      --queued;
+      return true;
+    }
+  }
+  for(unsigned i=1; i<workers.size(); ++i) {
+    worker_t *victim = workers[(index + i) % workers.size()];
+    lock_guard<mutex> guard(victim->lock);
+    if (!victim->tasks.empty()) {
+      task = move(victim->tasks.front());
+      victim->tasks.pop_front();
+      --queued;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ThreadPool::run_one()
+{
+  function<void()> task;
+  unsigned index = current_pool == this ? current : next++ % workers.size();
+  if (!take(index, task))
+    return false;
+  run(task);
+  return true;
+}
+
+void
+ThreadPool::run(function<void()> &task)
+{
+  task();
+  {
+    lock_guard<mutex> guard(idle_lock);
+    ++completed;
+  }
+  progress.notify_all();
+}
+
+void
+ThreadPool::wait(function<bool()> done)
+{
+  while(true) {
+    // 'done' turns true within a task, which is counted when it completes
+    unsigned long seen;
+    {
+      lock_guard<mutex> guard(idle_lock);
+      seen = completed;
+    }
+    if (done())
+      return;
+    if (run_one())
+      continue;
+    unique_lock<mutex> guard(idle_lock);
+    progress.wait(guard, [this, seen] { return queued > 0 || completed != seen; });
+  }
+}
+
+void
+ThreadPool::work(unsigned index)
+{
+  current_pool = this;
+  current = index;
+  while(true) {
+    function<void()> task;
+    if (take(index, task)) {
+      run(task);
+      continue;
+    }
+    unique_lock<mutex> guard(idle_lock);
+    idle.wait(guard, [this] { return stop || queued > 0; });
+    if (stop)
+      return;
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_HH_
+#define THREADPOOL_HH_
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+// Each worker owns a deque of tasks. It takes new work from the back of
+// its own deque and, when that is empty, steals from the front of the
+// others.
+class ThreadPool {
+    struct worker_t {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+    };
+    std::vector<worker_t*> workers;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> next;
+    std::atomic<bool> stop;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::atomic<unsigned> queued;
+    std::condition_variable progress; // a task was queued or completed
+    unsigned long completed;
+  public:
+    ThreadPool(unsigned size);
+    ~ThreadPool();
+    unsigned size() const { return workers.size(); }
+    void submit(std::function<void()> task);
+    // execute one queued task on the calling thread, if there is any
+    bool run_one();
+    // keep the calling thread busy with queued tasks until 'done' returns
+    // true, blocking while there is none; 'done' must turn true within a task
+    void wait(std::function<bool()> done);
+  private:
+    bool take(unsigned index, std::function<void()> &task);
+    void work(unsigned index);
+    void run(std::function<void()> &task);
+};
+
+#endif // #ifndef THREADPOOL_HH_
@@ -0,0 +1,152 @@
+#include "tokens.hh"
+#include "threadpool.hh"
+#include "scan.hh"
+
+#include <string.h>
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+// chunks per thread, for the fast ones to help with slow ones
+static const unsigned CHUNKS = 4;
+// smaller sources aren't worth splitting
+static const size_t MIN_CHUNK = 64 * 1024;
+
+vector<node_t*>
+lex_all(const char *begin, const char *end)
+{
+  vector<node_t*> tokens;
+  try {
+    lex_open(begin, end);
+    while(node_t *n = lex())
+      tokens.push_back(n);
+  }
+  catch(...) {
+    for(auto n: tokens)
+      node_free(n);
+    throw;
+  }
+  return tokens;
+}
+
+// Positions after a newline that is neither in a comment nor in a string,
+// close to every 'step' bytes. No token reaches across such a newline, so
+// the text between two of them lexes to the tokens lex() would return for
+// it when lexing the whole source. The scan follows the comments and
+// strings the way lex0 recognizes them.
+static vector<const char*>
+boundaries(const char *p, const char *end, size_t step)
+{
+  vector<const char*> out;
+  const char *target = p + step;
+  enum { CODE, STRING, BLOCK, LINE } context = CODE;
+  while(p < end) {
+    switch(context) {
+      case CODE: {
+        const char *event = p + scanner.until(p, end, '/', '"');
+        while(true) {
+          const char *from = max(p, target);
+          if (from >= event)
+            break;
+          const char *newline = (const char*)memchr(from, '\n', event - from);
+          if (!newline || newline + 1 == end)
+            break;
+          out.push_back(newline + 1);
+          target = newline + 1 + step;
+        }
+        p = event;
+        if (p == end)
+          break;
+        if (*p++ == '"') {
+          context = STRING;
+        } else if (p < end && *p == '*') {
+          context = BLOCK;
+          ++p;
+        } else if (p < end && *p == '/') {
+          context = LINE;
+          ++p;
+        }
+        // else '/' or '/=', what follows is code
+        break;
+      }
+      case STRING:
+        p += scanner.until(p, end, '"', '\\');
+        if (p == end)
+          break;
+        if (*p++ == '"')
+          context = CODE;
+        else if (p < end)
+          ++p; // escaped
+        break;
+      case BLOCK:
+        p += scanner.until(p, end, '*', '*');
+        if (p == end)
+          break;
+        if (++p < end && *p == '/') {
+          context = CODE;
+          ++p;
+        }
+        break;
+      case LINE:
+        p += scanner.until(p, end, '\n', '\n');
+        if (p == end)
+          break;
+        context = CODE;
+        if (++p > target && p < end) {
+          out.push_back(p);
+          target = p + step;
+        }
+        break;
+    }
+  }
+  return out;
+}
+
+vector<node_t*>
+lex_parallel(const char *begin, const char *end, ThreadPool &pool)
+{
+  size_t parts = (pool.size() + 1) * CHUNKS;
+  size_t step = max<size_t>((end - begin) / parts, MIN_CHUNK);
+  vector<const char*> starts = boundaries(begin, end, step);
+  if (starts.empty())
+    return lex_all(begin, end);
+  starts.insert(starts.begin(), begin);
+  starts.push_back(end);
+
+  size_t chunks = starts.size() - 1;
+  vector<vector<node_t*>> tokens(chunks);
+  vector<exception_ptr> errors(chunks);
+  atomic<size_t> done(0);
+  for(size_t i=0; i<chunks; ++i) {
+    pool.submit([&, i]() {
+      try {
+        tokens[i] = lex_all(starts[i], starts[i + 1]);
+      }
+      catch(...) {
+        errors[i] = current_exception();
+      }
+      ++done;
+    });
+  }
+  pool.wait([&]() { return done == chunks; });
+
+  // the first error is the one lexing in sequence would have run into
+  vector<node_t*> out;
+  for(size_t i=0; i<chunks; ++i) {
+    if (errors[i]) {
+      for(auto &chunk: tokens) {
+        for(auto n: chunk)
+          node_free(n);
+      }
+      rethrow_exception(errors[i]);
+    }
+  }
+  size_t size = 0;
+  for(auto &chunk: tokens)
+    size += chunk.size();
+  out.reserve(size);
+  for(auto &chunk: tokens)
+    out.insert(out.end(), chunk.begin(), chunk.end());
+  return out;
+}
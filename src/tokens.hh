@@ -0,0 +1,16 @@
+#ifndef TOKENS_HH_
+#define TOKENS_HH_
+
+#include "lex.hh"
+
+#include <vector>
+
+class ThreadPool;
+
+// The tokens of the source from 'begin' to 'end' in the order lex()
+// returns them; throws syntax_error like lex() does.
+std::vector<node_t*> lex_all(const char *begin, const char *end);
+// The same, lexing chunks of the source on 'pool' and the calling thread.
+std::vector<node_t*> lex_parallel(const char *begin, const char *end, ThreadPool &pool);
+
+#endif // #ifndef TOKENS_HH_
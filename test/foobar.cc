@@ -1,14 +1,33 @@
 #include <runtime.hh>
+#include <actor.hh>
+#include <document.hh>
+#include <mapper.hh>
+#include <nodetable.hh>
+#include <scan.hh>
+#include <server.hh>
+#include <tokens.hh>
 #include "fmemopen.h"
 #include "gtest.h"
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+
 using namespace std;
 
-static Runtime* test(const char *source) {
+static node_t* compile(const char *source, NodeTable *shared = nullptr) {
     printf("--------- parse --------\n");
     auto in = fmemopen((void*)source, strlen(source), "r");
-    auto root = parse(in);
+    auto root = parse(in, shared);
     fclose(in);
+    return root;
+}
+
+static Runtime* test(const char *source) {
+    auto root = compile(source);
 
     printf("--------- print --------\n");
     node_print(stdout, root);
@@ -50,5 +69,1201 @@ namespace {
 
     }
 
+    TEST(Optimizer, FoldAndDeadCode) {
+        auto rt = test(R"(int main(int a)
+{
+  a + 1;
+  return a + (2 + 3);
+  return 0;
+}
+)");
+        node_t *result = rt->call("main", 1);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(6, result->value.i);
+        rt->dump(stdout);
+
+        // the counts go on across versions of the program
+        ExecutionContext worker(rt->versions());
+        rt->insert(compile("int other(int a)\n{\n  return a;\n}\n"));
+        char *text = nullptr;
+        size_t size = 0;
+        FILE *out = open_memstream(&text, &size);
+        rt->dump(out);
+        fclose(out);
+        const char *dce = strstr(text, "\ndce ");
+        ASSERT_TRUE(dce);
+        unsigned changes = 0;
+        ASSERT_EQ(1, sscanf(dce, " dce %u", &changes));
+        free(text);
+        ASSERT_LE(1u, changes);
+    }
+
+    TEST(Optimizer, FoldWrapsAround) {
+        auto rt = test(R"(int wrap()
+{
+  return 2147483647 + 1;
+}
+int overflow()
+{
+  return ((0 - 2147483647) - 1) / (0 - 1);
+}
+)");
+        ASSERT_EQ(INT_MIN, rt->call("wrap")->value.i);
+        // left to run time instead of trapping while folding
+        ASSERT_EQ(0, rt->arity("overflow"));
+    }
+
+    static unsigned count_tokens(node_t *n, int tkn) {
+        unsigned count = n->tkn == tkn;
+        for(node_t *p = n->down; p; p=p->next)
+            count += count_tokens(p, tkn);
+        return count;
+    }
+
+    TEST(Optimizer, ReduceStrength) {
+        auto root = compile(R"(int f(int x, double d)
+{
+  return x * 8 + (x + x) + ((x + 1) - (x + 1)) + x * 1 + d * 4;
+}
+)");
+        PassManager optimizer;
+        optimizer.run(root->down);
+        node_print(stdout, root->down);
+        // only d * 4 is left, d may not be an int
+        ASSERT_EQ(1u, count_tokens(root->down, '*'));
+        ASSERT_EQ(2u, count_tokens(root->down, TKN_SHL));
+        node_free(root);
+
+        auto rt = test(R"(int g(int x)
+{
+  return x * 8 + (x + x) + ((x + 1) - (x + 1)) + x * 1 + (x == x);
+}
+)");
+        ASSERT_EQ(34, rt->call("g", 3)->value.i);
+        ASSERT_EQ(-1342177279, rt->call("g", 268435456)->value.i);
+
+        // unary operators have a single operand
+        rt->insert(compile(R"(int h(int x)
+{
+  return 1 + -x + (-x - -x) + (x << -(-1)) + (*x - *x);
+}
+int k(int x)
+{
+  return 1 + -x + (x << -(-1)) + -(2 + 3);
+}
+)"));
+        ASSERT_THROW(rt->call("h", 3), ExecutionContext::script_error);
+        ASSERT_EQ(-1, rt->call("k", 3)->value.i);
+    }
+
+    TEST(Optimizer, Inline) {
+        auto rt = test(R"(int add(int a, int b)
+{
+  return a + b;
+}
+int twice(int a)
+{
+  return add(a, a);
+}
+int main(int a, int b)
+{
+  return twice(b) + add(b, a) + a;
+}
+)");
+        node_t *result = rt->call("main", 1, 2);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(8, result->value.i);
+        ASSERT_EQ(4u, rt->inlined_calls());
+
+        // callers are inlined again when a callee is redefined
+        rt->insert(compile(R"(int add(int a, int b)
+{
+  return b + 10;
+}
+)"));
+        result = rt->call("main", 1, 2);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(24, result->value.i);
+        rt->dump(stdout);
+    }
+
+    TEST(Optimizer, EvaluateAtLoadTime) {
+        auto rt = new Runtime();
+        rt->inline_budget(0);
+        rt->insert(compile(R"(int scale(int a, int b)
+{
+  return a + a + b;
+}
+int forever(int a)
+{
+  return forever(a);
+}
+int main(int x)
+{
+  return scale(3, 7) + x;
+}
+int hang()
+{
+  return forever(1);
+}
+)"));
+        // forever(1) ran out of fuel and was left alone
+        ASSERT_EQ(1u, rt->evaluated_calls());
+        node_t *result = rt->call("main", 1);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(14, result->value.i);
+
+        // a call failing at load time is left to run time
+        unsigned evaluated = rt->evaluated_calls();
+        rt->insert(compile(R"(int inverse(int a)
+{
+  return 1000 / a;
+}
+int guarded(int x)
+{
+  if (x > 0)
+    return inverse(0);
+  return inverse(x - 1);
+}
+)"));
+        ASSERT_EQ(evaluated, rt->evaluated_calls());
+        ASSERT_EQ(-500, rt->call("guarded", -1)->value.i);
+        ASSERT_THROW(rt->call("guarded", 1), ExecutionContext::script_error);
+        rt->dump(stdout);
+    }
+
+    TEST(Optimizer, Specialize) {
+        auto rt = test(R"(int fee(int tenant, int amount)
+{
+  if (tenant == 1) {
+    return amount * 2;
+  } else {
+    if (amount > 100)
+      return amount - 10;
+  }
+  return amount;
+}
+)");
+        node_t *result = rt->call("fee", 2, 200);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(190, result->value.i);
+
+        auto fee1 = rt->specialize("fee", {{0, 1}});
+        result = rt->call(fee1.c_str(), 200);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(400, result->value.i);
+
+        auto fee2 = rt->specialize("fee", {{0, 2}});
+        ASSERT_NE(fee1, fee2);
+        ASSERT_EQ(fee2, rt->specialize("fee", {{0, 2}}));
+        result = rt->call(fee2.c_str(), 50);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(50, result->value.i);
+        rt->dump(stdout);
+    }
+
+    TEST(Batch, MatchesCall) {
+        auto rt = test(R"(int clamp(int v, int limit)
+{
+  if (v > limit)
+    return limit;
+  return v;
+}
+int main(int a, int b)
+{
+  if (a % 3 == 0)
+    return clamp(a * b, 1000);
+  return a - b;
+}
+)");
+        const size_t rows = 3000;
+        int a[rows], b[rows], out[rows];
+        for(size_t i=0; i<rows; ++i) {
+            a[i] = i;
+            b[i] = i % 7;
+        }
+        rt->call_batch("main", rows, {a, b}, out);
+        for(size_t i=0; i<rows; ++i) {
+            node_t *result = rt->call("main", a[i], b[i]);
+            ASSERT_EQ(result->value.i, out[i]);
+        }
+        ASSERT_THROW(rt->call_batch("missing", rows, {a}, out), ExecutionContext::script_error);
+        ASSERT_THROW(rt->call_batch("clamp", rows, {a}, out), ExecutionContext::script_error);
+        ASSERT_THROW(rt->call("missing"), ExecutionContext::script_error);
+        ASSERT_EQ(7, rt->call("main", 10, 3)->value.i);
+
+        // runaway recursion, unary operators and natives with results of
+        // their own
+        rt->insert(compile(R"(int down(int n)
+{
+  if (n == 0)
+    return 0;
+  return 1 + down(n - 1);
+}
+int negated(int a, int b)
+{
+  return -twice(a) + b;
+}
+)"));
+        rt->native("twice", [](node_t *args) {
+          return node_new_value(args->value.i * 2);
+        });
+        rt->call_batch("down", rows, {b}, out);
+        for(size_t i=0; i<rows; ++i)
+            ASSERT_EQ(b[i], out[i]);
+        for(size_t i=0; i<rows; ++i)
+            a[i] = -1;
+        ASSERT_THROW(rt->call_batch("down", rows, {a}, out), ExecutionContext::stack_overflow);
+        size_t ast = memory_used(MEMORY_AST);
+        for(size_t i=0; i<rows; ++i)
+            a[i] = i;
+        rt->call_batch("negated", rows, {a, b}, out);
+        for(size_t i=0; i<rows; ++i)
+            ASSERT_EQ(b[i] - 2 * a[i], out[i]);
+        ASSERT_EQ(ast, memory_used(MEMORY_AST));
+    }
+
+    TEST(Parallel, ForSpawnJoin) {
+        auto rt = test(R"(int square(int i)
+{
+  return i * i;
+}
+int body(int i)
+{
+  add(square(i));
+  return 0;
+}
+int main(int n)
+{
+  parallel_for(0, n, body);
+  return join(spawn(square, n)) + join(spawn(square, 2));
+}
+)");
+        std::atomic<int> sum(0);
+        rt->native("add", [&sum](node_t *args) {
+          sum += args->value.i;
+          return nullptr;
+        });
+        rt->threads(4);
+        node_t *result = rt->call("main", 100);
+        ASSERT_EQ(TKN_VALUE_INT, result->tkn);
+        ASSERT_EQ(10004, result->value.i);
+        ASSERT_EQ(328350, sum);
+    }
+
+    TEST(Parallel, FailuresAndLifetime) {
+        const char *source = R"(int depth(int n)
+{
+  if (n == 0)
+    return 0;
+  return 1 + depth(n - 1);
+}
+int deep(int i)
+{
+  return depth(i * 100000);
+}
+int many(int n)
+{
+  if (n == 0)
+    return 0;
+  return join(spawn(depth, n)) + many(n - 1);
+}
+int fail(int n)
+{
+  return join(spawn(depth, n));
+}
+int range(int n)
+{
+  parallel_for(0, n, deep);
+  return 0;
+}
+int fire(int n)
+{
+  spawn(depth, n);
+  return 0;
+}
+)";
+        auto rt = test(source);
+        rt->threads(2);
+        // neither handles nor results are left behind
+        ASSERT_EQ(5050, rt->call("many", 100)->value.i);
+        size_t ast = memory_used(MEMORY_AST);
+        ASSERT_EQ(5050, rt->call("many", 100)->value.i);
+        ASSERT_EQ(ast, memory_used(MEMORY_AST));
+
+        // failures reach the caller, which can go on
+        ASSERT_THROW(rt->call("fail", 200000), ExecutionContext::stack_overflow);
+        ASSERT_THROW(rt->call("range", 3), ExecutionContext::stack_overflow);
+        ASSERT_EQ(3, rt->call("fail", 3)->value.i);
+
+        // a task may outlive the call that spawned it, not its context
+        ASSERT_EQ(0, rt->call("fire", 50000)->value.i);
+        delete rt;
+    }
+
+    TEST(Runtime, SharedProgram) {
+        auto rt = test(R"(int fib(int n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+)");
+        std::shared_ptr<const Program> program = rt->share();
+        std::vector<std::thread> threads;
+        std::atomic<int> failures(0);
+        for(int t=0; t<4; ++t)
+            threads.push_back(std::thread([program, &failures] {
+                ExecutionContext context(program);
+                for(int i=0; i<20; ++i) {
+                    node_t *result = context.call("fib", 15);
+                    if (result->value.i != 610)
+                        ++failures;
+                }
+            }));
+        // changes go to new versions, the shared one stays as it is
+        for(int i=0; i<50; ++i) {
+            std::string source = "int g" + std::to_string(i) + "(int n)\n{\n  return fib(n);\n}\n";
+            FILE *in = fmemopen((void*)source.data(), source.size(), "r");
+            rt->insert(parse(in));
+            fclose(in);
+        }
+        rt->native("answer", [](node_t*) -> node_t* { return nullptr; });
+        std::string fib10 = rt->specialize("fib", {{0, 10}});
+        for(auto &t: threads)
+            t.join();
+        ASSERT_EQ(0, failures);
+        ASSERT_EQ(-1, program->arity("g0"));
+        ASSERT_EQ(-1, program->arity(fib10));
+        ASSERT_EQ(1, rt->arity("g49"));
+        ASSERT_EQ(55, rt->call(fib10.c_str())->value.i);
+        ASSERT_EQ(55, rt->call("g49", 10)->value.i);
+    }
+
+    TEST(Actor, CallAndPost) {
+        auto rt = test(R"(int twice(int n)
+{
+  return n + n;
+}
+int relay(int n)
+{
+  post("logger", log, twice(n));
+  return n;
+}
+int log(int n)
+{
+  record(n);
+  return 0;
+}
+)");
+        std::atomic<int> sum(0), records(0);
+        rt->native("record", [&sum, &records](node_t *args) {
+          sum += args->value.i;
+          ++records;
+          return nullptr;
+        });
+        Actor worker("worker", rt->share(), 4);
+        Actor logger("logger", rt->share());
+        ASSERT_THROW(Actor("logger", rt->share()), std::invalid_argument);
+        ASSERT_EQ(&logger, Actor::find("logger"));
+
+        std::vector<std::thread> threads;
+        std::atomic<int> failures(0);
+        for(int t=0; t<4; ++t)
+            threads.push_back(std::thread([&worker, &failures, t] {
+                for(int i=0; i<50; ++i) {
+                    node_t *result = worker.call("twice", i + t).get();
+                    if (result->value.i != 2 * (i + t))
+                        ++failures;
+                    node_free(result);
+                }
+            }));
+        for(auto &t: threads)
+            t.join();
+        ASSERT_EQ(0, failures);
+
+        for(int i=1; i<=10; ++i)
+            node_free(worker.call("relay", i).get());
+        while(records < 10)
+            std::this_thread::yield();
+        ASSERT_EQ(110, sum);
+
+        // posting leaves nothing behind
+        size_t ast = memory_used(MEMORY_AST);
+        for(int i=1; i<=1000; ++i)
+            node_free(worker.call("relay", i).get());
+        while(records < 1010)
+            std::this_thread::yield();
+        ASSERT_EQ(ast, memory_used(MEMORY_AST));
+    }
+
+    TEST(Actor, FailedRequest) {
+        auto rt = test(R"(int depth(int n)
+{
+  if (n == 0)
+    return 0;
+  return 1 + depth(n - 1);
+}
+)");
+        Actor worker("worker", rt->share());
+        auto failed = worker.call("depth", 200000);
+        ASSERT_THROW(failed.get(), ExecutionContext::stack_overflow);
+        // the actor is still running
+        node_t *result = worker.call("depth", 10).get();
+        ASSERT_EQ(10, result->value.i);
+        node_free(result);
+    }
+
+    TEST(Async, EventLoop) {
+        auto rt = test(R"(int main(int i)
+{
+  return fetch(i) + now(1) + fetch(i + 1);
 }
+)");
+        // a stand-in for asynchronous I/O: completions are queued and an
+        // eventfd wakes the loop to deliver them
+        int loop = epoll_create1(0);
+        int ready = eventfd(0, EFD_NONBLOCK);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = ready;
+        ASSERT_EQ(0, epoll_ctl(loop, EPOLL_CTL_ADD, ready, &event));
 
+        std::vector<std::pair<std::function<void(node_t*)>, int>> queued;
+        // results stay with the natives
+        std::vector<node_t*> results;
+        rt->native_async("fetch", [&queued, ready](node_t *args, std::function<void(node_t*)> complete) {
+          queued.push_back({ complete, args->value.i * 10 });
+          uint64_t one = 1;
+          ASSERT_EQ(8, write(ready, &one, sizeof(one)));
+        });
+
+        // completes before returning, the script mustn't suspend
+        rt->native_async("now", [&results](node_t *args, std::function<void(node_t*)> complete) {
+          results.push_back(node_new_value(args->value.i));
+          complete(results.back());
+        });
+
+        size_t ast = memory_used(MEMORY_AST);
+        const int calls = 20000;
+        int finished = 0;
+        long sum = 0;
+        for(int i=0; i<calls; ++i) {
+            node_t *arg = node_new_value(i);
+            rt->call_async("main", { arg }, [&finished, &sum](node_t *result) {
+              sum += result->value.i;
+              ++finished;
+            });
+            node_free(arg);
+        }
+        ASSERT_EQ(0, finished);
+
+        while(finished < calls) {
+            epoll_event events[1];
+            ASSERT_EQ(1, epoll_wait(loop, events, 1, 1000));
+            uint64_t count;
+            ASSERT_EQ(8, read(ready, &count, sizeof(count)));
+            auto batch = std::move(queued);
+            queued.clear();
+            for(auto &c: batch) {
+                results.push_back(node_new_value(c.second));
+                c.first(results.back());
+            }
+        }
+        close(ready);
+        close(loop);
+        // sum of 10 * (2i + 1) + 1
+        ASSERT_EQ(10L * calls * calls + calls, sum);
+        for(auto result: results)
+            node_free(result);
+        // nor do the calls and their arguments
+        ASSERT_EQ(ast, memory_used(MEMORY_AST));
+    }
+
+    TEST(Runtime, ConditionsWithoutValue) {
+        auto rt = test(R"(int branch()
+{
+  if (nothing(0))
+    return 1;
+  return 2;
+}
+int loops()
+{
+  while (undefined)
+    return 1;
+  do
+    nothing(1);
+  while (nothing(0));
+  for (0; undefined; 1)
+    return 3;
+  return 4;
+}
+)");
+        rt->native("nothing", [](node_t*) -> node_t* { return nullptr; });
+        ASSERT_EQ(2, rt->call("branch")->value.i);
+        ASSERT_EQ(4, rt->call("loops")->value.i);
+    }
+
+    TEST(Runtime, UnaryOperators) {
+        auto rt = test(R"(int negate(int x)
+{
+  return -x;
+}
+int same(int x)
+{
+  return +x;
+}
+int fraction(int x)
+{
+  return -"half";
+}
+int pointer(int x)
+{
+  return *x;
+}
+)");
+        ASSERT_EQ(-7, rt->call("negate", 7)->value.i);
+        ASSERT_EQ(INT_MIN, rt->call("negate", INT_MIN)->value.i);
+        ASSERT_EQ(7, rt->call("same", 7)->value.i);
+        ASSERT_THROW(rt->call("fraction", 1), ExecutionContext::script_error);
+        ASSERT_THROW(rt->call("pointer", 1), ExecutionContext::script_error);
+        ASSERT_EQ(3, rt->call("negate", -3)->value.i);
+    }
+
+    TEST(Runtime, TailCallsAndDepthLimit) {
+        auto rt = test(R"(int loop(int n, int acc)
+{
+  if (n == 0)
+    return acc;
+  return loop(n - 1, acc + 1);
+}
+int depth(int n)
+{
+  if (n == 0)
+    return 0;
+  return 1 + depth(n - 1);
+}
+)");
+        rt->depth_limit(100, 10000);
+        // runs in a single frame
+        ASSERT_EQ(100000, rt->call("loop", 100000, 0)->value.i);
+        ASSERT_EQ(50, rt->call("depth", 50)->value.i);
+        ASSERT_THROW(rt->call("depth", 1000), ExecutionContext::stack_overflow);
+
+        // the failed call left its values behind in the nursery
+        rt->depth_limit(3000, 100000);
+        ASSERT_THROW(rt->call("depth", 10000), ExecutionContext::stack_overflow);
+        unsigned minor = rt->gc_stats().minor;
+        ASSERT_EQ(1000, rt->call("depth", 1000)->value.i);
+        ASSERT_EQ(minor, rt->gc_stats().minor);
+
+        // still usable, and not limited by the C stack
+        rt->depth_limit(1000000, 10000000);
+        ASSERT_EQ(100000, rt->call("depth", 100000)->value.i);
+    }
+
+    TEST(Runtime, Preemption) {
+        auto rt = test(R"(int spin(int n)
+{
+  while (true)
+    tick(n);
+  return 0;
+}
+int fib(int n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+)");
+        int ticks = 0;
+        rt->native("tick", [&ticks](node_t *args) {
+          ++ticks;
+          return nullptr;
+        });
+
+        // the call and each iteration cost one unit
+        node_t *one = node_new_value(1);
+        auto spin = rt->prepare("spin", { one });
+        node_free(one);
+        ASSERT_FALSE(spin->run(1000));
+        ASSERT_EQ(1000, ticks);
+        ASSERT_FALSE(spin->run(500));
+        ASSERT_EQ(1500, ticks);
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_FALSE(spin->run(LONG_MAX, start + std::chrono::milliseconds(20)));
+        ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+        spin.reset(); // abort
+
+        node_t *ten = node_new_value(10);
+        auto fib = rt->prepare("fib", { ten });
+        node_free(ten);
+        int slices = 1;
+        while(!fib->run(10))
+            ++slices;
+        ASSERT_EQ(55, fib->result()->value.i);
+        ASSERT_EQ(18, slices); // fib(10) makes 177 calls
+    }
+
+    TEST(Heap, CollectsTemporaries) {
+        auto rt = test(R"(int sum(int n)
+{
+  if (n == 0)
+    return 0;
+  return n + sum(n - 1);
+}
+)");
+        ExecutionContext::Handle kept(*rt, rt->call("sum", 100));
+        for(int i=0; i<100; ++i)
+            ASSERT_EQ(4501500, rt->call("sum", 3000)->value.i);
+        ASSERT_EQ(5050, kept->value.i);
+
+        const Heap::stats_t &stats = rt->gc_stats();
+        ASSERT_GT(stats.minor, 0u);
+        ASSERT_GT(stats.major, 0u);
+        // what survives is bounded by the deepest recursion, not by the calls
+        ASSERT_LT(stats.old_capacity, 64u * 1024);
+        printf("%u minor, %u major collections, max pause %.3f ms\n",
+               stats.minor, stats.major, stats.max_pause * 1000.0);
+    }
+
+    TEST(Heap, CallsResetNursery) {
+        auto rt = test(R"(int main(int a, int b)
+{
+  return same(a * b + a) - b;
+}
+)");
+        rt->native("same", [](node_t *args) {
+          return args;
+        });
+        for(int i=0; i<10000; ++i)
+            ASSERT_EQ(i * 3 + i - 3, rt->call("main", i, 3)->value.i);
+        // temporaries die with each call, nothing had to be collected
+        ASSERT_EQ(0u, rt->gc_stats().minor);
+    }
+
+    TEST(Memory, AccountingAndLimit) {
+        size_t ast = memory_used(MEMORY_AST);
+        auto rt = test(R"(int depth(int n)
+{
+  if (n == 0)
+    return 0;
+  return 1 + depth(n - 1);
+}
+)");
+        ASSERT_GT(memory_used(MEMORY_AST), ast);
+        ASSERT_GT(memory_used(MEMORY_LEXER), 0u);
+        ASSERT_GT(rt->memory().ast, 0u);
+        ASSERT_GT(rt->memory().values, 0u);
+
+        rt->memory_limit(1024 * 1024);
+        ASSERT_THROW(rt->call("depth", 100000), out_of_memory);
+        // only the call failed
+        ASSERT_EQ(10, rt->call("depth", 10)->value.i);
+        ASSERT_LE(rt->memory().total() - rt->memory().ast, 1024u * 1024);
+        memory_print(stdout);
+    }
+
+    TEST(NodeTable, SharesSubtrees) {
+        string source;
+        for(int i=0; i<50; ++i)
+            source += "int f" + to_string(i) + "(int a, int b)\n{\n  return a * 2 + b * 3 - 1;\n}\n";
+
+        size_t ast = memory_used(MEMORY_AST);
+        auto plain = compile(source.c_str());
+        size_t unshared = memory_used(MEMORY_AST) - ast;
+
+        NodeTable table;
+        ast = memory_used(MEMORY_AST);
+        auto root = compile(source.c_str(), &table);
+        size_t shared = memory_used(MEMORY_AST) - ast;
+        ASSERT_EQ(shared, table.bytes());
+        ASSERT_EQ(unshared, table.bytes() + table.saved());
+        ASSERT_LT(shared * 4, unshared);
+        // everything but the names of the functions is shared
+        ASSERT_EQ(root->down->down, root->down->next->down);
+        ASSERT_NE(root->down, root->down->next);
+
+        Runtime rt, unshared_rt;
+        rt.insert(root);
+        unshared_rt.insert(plain);
+        ASSERT_EQ(7, rt.call("f7", 1, 2)->value.i);
+        ASSERT_EQ(unshared_rt.memory().ast - table.saved(), rt.memory().ast);
+    }
+
+    TEST(Runtime, HotReload) {
+        const char *source = R"(int base(int a)
+{
+  return a + 1;
+}
+int twice(int a)
+{
+  return base(a) * 2;
+}
+int other(int a)
+{
+  return a - 1;
+}
+int fib(int n)
+{
+  if (n < 2)
+    return base(n) - 1;
+  return fib(n - 1) + fib(n - 2);
+}
+)";
+        Runtime rt;
+        rt.insert(compile(source));
+        ExecutionContext worker(rt.versions());
+        ASSERT_EQ(8, worker.call("twice", 3)->value.i);
+        node_t *ten = node_new_value(10);
+        auto running = worker.prepare("fib", { ten });
+        node_free(ten);
+        ASSERT_FALSE(running->run(10));
+
+        ASSERT_TRUE(rt.reload(compile(source)).empty());
+        string changed = source;
+        changed.replace(changed.find("a + 1"), 5, "a + 2");
+        std::set<string> expected = { "base", "twice", "fib" };
+        ASSERT_EQ(expected, rt.reload(compile(changed.c_str())));
+        ASSERT_EQ(10, rt.call("twice", 3)->value.i);
+        ASSERT_EQ(10, worker.call("twice", 3)->value.i);
+        ASSERT_EQ(2, worker.call("other", 3)->value.i);
+
+        // the call started before finishes on the version it started with,
+        // which is freed with it
+        while(!running->run(100))
+            ;
+        ASSERT_EQ(55, running->result()->value.i);
+        size_t ast = memory_used(MEMORY_AST);
+        running.reset();
+        ASSERT_GT(ast - memory_used(MEMORY_AST), 20 * sizeof(node_t));
+        ASSERT_EQ(144, worker.call("fib", 10)->value.i);
+
+        // a function no longer calling base isn't compiled again with it
+        string unlinked = changed;
+        unlinked.replace(unlinked.find("base(a) * 2"), 11, "a * 4");
+        ASSERT_EQ(std::set<string>({ "twice" }), rt.reload(compile(unlinked.c_str())));
+        unlinked.replace(unlinked.find("a + 2"), 5, "a + 3");
+        ASSERT_EQ(std::set<string>({ "base", "fib" }), rt.reload(compile(unlinked.c_str())));
+
+        // functions missing from the source go, along with their callers'
+        // inlined copies
+        const char *other = "int other(int a)\n{\n  return a - 1;\n}\n";
+        unlinked.erase(unlinked.find(other), strlen(other));
+        ASSERT_EQ(std::set<string>({ "other" }), rt.reload(compile(unlinked.c_str())));
+        ASSERT_EQ(-1, rt.arity("other"));
+        ASSERT_THROW(worker.call("other", 3), ExecutionContext::script_error);
+        const char *base = "int base(int a)\n{\n  return a + 3;\n}\n";
+        unlinked.erase(unlinked.find(base), strlen(base));
+        ASSERT_EQ(std::set<string>({ "base", "fib" }), rt.reload(compile(unlinked.c_str())));
+        ASSERT_THROW(rt.call("fib", 1), ExecutionContext::script_error);
+        ASSERT_EQ(12, rt.call("twice", 3)->value.i);
+    }
+
+    TEST(Runtime, InsertsWhileReading) {
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        FILE *in = fdopen(fds[0], "r");
+        Runtime rt;
+        std::atomic<int> inserted(0);
+        vector<int> results;
+        std::thread reader([&]() {
+            rt.insert(in, [&](node_t *function) {
+                results.push_back(rt.call(function->text, 20)->value.i);
+                ++inserted;
+            });
+        });
+
+        // the first function runs before the second is written
+        string first = "int half(int a)\n{\n  return a / 2;\n}\n";
+        ASSERT_EQ((ssize_t)first.size(), write(fds[1], first.data(), first.size()));
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while(inserted == 0 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        int before = inserted;
+        string second = "int quarter(int a)\n{\n  return half(half(a));\n}\n";
+        ASSERT_EQ((ssize_t)second.size(), write(fds[1], second.data(), second.size()));
+        close(fds[1]);
+        reader.join();
+        fclose(in);
+        ASSERT_EQ(1, before);
+        ASSERT_EQ(2, inserted);
+        ASSERT_EQ(vector<int>({ 10, 5 }), results);
+    }
+
+    TEST(Runtime, BulkInsert) {
+        vector<string> sources = { "int base(int a)\n{\n  return a + 1;\n}\n" };
+        for(int i = 0; i < 100; ++i) {
+            sources.push_back("int f" + std::to_string(i) + "(int x)\n{\n  return base(x) * " +
+                              std::to_string(i) + ";\n}\n");
+        }
+        sources.push_back("int broken(int x)\n{\n  return x +;\n}\n");
+        sources.push_back("int global;\n");
+
+        Runtime one, bulk;
+        for(size_t i = 0; i < 101; ++i)
+            one.insert(compile(sources[i].c_str()));
+        vector<string> errors = bulk.insert(sources);
+        ASSERT_EQ(sources.size(), errors.size());
+        for(size_t i = 0; i < 101; ++i)
+            ASSERT_EQ("", errors[i]);
+        ASSERT_NE("", errors[101]);
+        ASSERT_NE("", errors[102]);
+        ASSERT_EQ(-1, bulk.arity("broken"));
+        for(int i = 0; i < 100; i += 7) {
+            string name = "f" + std::to_string(i);
+            ASSERT_EQ(one.call(name.c_str(), 4)->value.i, bulk.call(name.c_str(), 4)->value.i);
+        }
+
+        // later texts replace functions, as insert(node_t*) does
+        bulk.insert(compile("int seven()\n{\n  return 7;\n}\n"));
+        errors = bulk.insert({ "int base(int a)\n{\n  return a + 2;\n}\n", "int seven()\n{\n  return 8;\n}\n" });
+        ASSERT_EQ(vector<string>({ "", "" }), errors);
+        ASSERT_EQ(18, bulk.call("f3", 4)->value.i);
+        ASSERT_EQ(8, bulk.call("seven")->value.i);
+
+        // an arena goes with the last function using it
+        size_t ast = memory_used(MEMORY_AST);
+        Runtime replaced;
+        ASSERT_EQ(vector<string>({ "" }), replaced.insert({ "int nine()\n{\n  return 9;\n}\n" }));
+        ASSERT_LT(ast + 60000, memory_used(MEMORY_AST));
+        replaced.insert(compile("int nine()\n{\n  return 10;\n}\n"));
+        ASSERT_GT(ast + 60000, memory_used(MEMORY_AST));
+        ASSERT_EQ(10, replaced.call("nine")->value.i);
+
+        // one at a time the time grows linearly with the functions, as long
+        // as no other context shares the program
+        auto insert_each = [](int n) {
+            vector<node_t*> roots;
+            for(int i = 0; i < n; ++i)
+                roots.push_back(compile(("int g" + std::to_string(i) + "(int x)\n{\n  return x + 1;\n}\n").c_str()));
+            Runtime rt;
+            auto start = std::chrono::steady_clock::now();
+            for(auto root: roots)
+                rt.insert(root);
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        double few = insert_each(200), many = insert_each(2000);
+        ASSERT_LT(many, few * 30) << few << " s for 200, " << many << " s for 2000";
+    }
+
+    TEST(Server, CallsOverSocket) {
+        string base = "/tmp/cscript-test-" + to_string(getpid());
+        string script = base + ".cs", socket_path = base + ".sock";
+        auto save = [&script](const char *source) {
+            FILE *out = fopen(script.c_str(), "w");
+            fputs(source, out);
+            fclose(out);
+        };
+        save("int add(int a, int b)\n{\n  return a + b;\n}\n");
+
+        Server server(socket_path);
+        std::thread serving([&server]() { server.run(); });
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, socket_path.c_str());
+        ASSERT_EQ(0, connect(fd, (sockaddr*)&address, sizeof(address)));
+        auto request = [fd](const string &line) {
+            string sent = line + "\n", reply;
+            EXPECT_EQ((ssize_t)sent.size(), write(fd, sent.data(), sent.size()));
+            char c;
+            while(read(fd, &c, 1) == 1 && c != '\n')
+                reply += c;
+            // without the time it took
+            return reply.substr(0, reply.rfind(' '));
+        };
+
+        EXPECT_EQ("ok 5", request("call " + script + " add(2, 3)"));
+        EXPECT_EQ("ok -1", request("call " + script + " add(2,-3)"));
+        EXPECT_EQ("error add takes 2 arguments", request("call " + script + " add(2)"));
+        EXPECT_EQ("error unknown function 'sub'", request("call " + script + " sub(2, 3)"));
+        save("int sub(int a, int b)\n{\n  return a - b;\n}\nint add(int a, int b)\n{\n  return a + b;\n}\n");
+        EXPECT_EQ("ok -1", request("call " + script + " sub(2, 3)"));
+        save("int add(int a, int b)\n{\n  return a +;\n}\n");
+        EXPECT_EQ(0u, request("call " + script + " add(2, 3)").find("error " + script + ": "));
+        EXPECT_EQ("error unknown request", request("load " + script));
+
+        // a failed call doesn't take the server down, one that doesn't end
+        // is stopped
+        save(R"(int quotient(int a, int b)
+{
+  return a / b;
+}
+int missing(int a)
+{
+  return nowhere(a);
+}
+int spin(int n)
+{
+  while (n > 0)
+    n + 1;
+  return 0;
+}
+)");
+        server.limit(LONG_MAX, std::chrono::milliseconds(50));
+        EXPECT_EQ("error division by zero", request("call " + script + " quotient(1, 0)"));
+        EXPECT_EQ("error arithmetic on values other than ints", request("call " + script + " quotient(1.5, 1)"));
+        EXPECT_EQ("error unknown function 'nowhere'", request("call " + script + " missing(1)"));
+        EXPECT_EQ("error spin exceeded its budget", request("call " + script + " spin(1)"));
+        EXPECT_EQ("ok 0", request("call " + script + " spin(0)"));
+        EXPECT_EQ("ok 3", request("call " + script + " quotient(7, 2)"));
+        server.limit(1000, std::chrono::milliseconds(1000));
+        EXPECT_EQ("error spin exceeded its budget", request("call " + script + " spin(1)"));
+        string stats = request("stats");
+        EXPECT_EQ(0u, stats.find("requests 14 errors 9 loads 4 mean ")) << stats;
+
+        close(fd);
+        server.stop();
+        serving.join();
+        unlink(script.c_str());
+    }
+
+    TEST(Mapper, KeepsOrderAcrossThreads) {
+        Runtime rt;
+        rt.insert(compile(R"(int f(int a, int b)
+{
+  if (a < b)
+    return b - a;
+  return a * b + 1;
+}
+int first(int a, int b)
+{
+  return a;
+}
+)"));
+        string input, expected;
+        for(int i=0; i<200000; ++i) {
+            int a = i % 1000 - 500, b = i % 777 - 300;
+            input += to_string(a) + "\t" + to_string(b) + (i % 3 ? "\n" : "\r\n");
+            expected += to_string(a < b ? b - a : a * b + 1) + "\n";
+        }
+        string base = "/tmp/cscript-test-" + to_string(getpid());
+        auto map = [&](const string &in, const char *function, unsigned threads) {
+            FILE *file = fopen((base + ".in").c_str(), "w");
+            fwrite(in.data(), 1, in.size(), file);
+            fclose(file);
+            int from = open((base + ".in").c_str(), O_RDONLY);
+            int to = open((base + ".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            Mapper mapper(rt.share(), function, threads);
+            struct closer {
+                int from, to;
+                ~closer() { close(from); close(to); }
+            } files { from, to };
+            mapper.run(from, to);
+            file = fopen((base + ".out").c_str(), "r");
+            string out;
+            char buffer[4096];
+            while(size_t n = fread(buffer, 1, sizeof(buffer), file))
+                out.append(buffer, n);
+            fclose(file);
+            return out;
+        };
+        ASSERT_EQ(expected, map(input, "f", 1));
+        ASSERT_EQ(expected, map(input, "f", 3));
+
+        // a pipe hands over a little at a time
+        int pipe_fds[2];
+        ASSERT_EQ(0, pipe(pipe_fds));
+        std::thread writer([&input, &pipe_fds]() {
+            for(size_t at = 0; at < input.size(); at += 4000) {
+                size_t n = min<size_t>(4000, input.size() - at);
+                if (write(pipe_fds[1], input.data() + at, n) != (ssize_t)n)
+                    break;
+            }
+            close(pipe_fds[1]);
+        });
+        int to = open((base + ".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        Mapper piped(rt.share(), "f", 3);
+        ASSERT_EQ(200000u, piped.run(pipe_fds[0], to));
+        writer.join();
+        close(pipe_fds[0]);
+        close(to);
+        FILE *file = fopen((base + ".out").c_str(), "r");
+        string out;
+        char buffer[4096];
+        while(size_t n = fread(buffer, 1, sizeof(buffer), file))
+            out.append(buffer, n);
+        fclose(file);
+        ASSERT_EQ(expected, out);
+
+        // fields that aren't integers are passed as they are
+        ASSERT_EQ("word\n2.5\n-7\n", map("word\t1\n2.5\t1\n-7\t1", "first", 2));
+        ASSERT_THROW(map("1\t2\n3\n", "f", 1), record_error);
+        ASSERT_THROW(Mapper(rt.share(), "g"), record_error);
+        unlink((base + ".in").c_str());
+        unlink((base + ".out").c_str());
+    }
+
+    static vector<string> tokens(const string &source) {
+        auto in = fmemopen((void*)source.data(), source.size(), "r");
+        lex_open(in);
+        vector<string> out;
+        while(node_t *n = lex()) {
+            out.push_back(to_string(n->tkn) + (n->text ? n->text : ""));
+            lexfree(n);
+        }
+        lex_open(nullptr);
+        fclose(in);
+        return out;
+    }
+
+    TEST(Lexer, ScannersAgree) {
+        string source;
+        for(int i=0; i<200; ++i) {
+            source += "/* a block comment with * and ** inside, long enough to span several blocks */\n";
+            source += "// a line comment " + string(i % 50, '/') + "\n";
+            source += "int a_rather_long_identifier_name_" + to_string(i) + "   (\t\t int x)\n";
+            source += "{ println(\"a string with \\\" and \\\\ escapes " + string(i % 40, 'x') + "\"); }\n";
+        }
+        scan_level_e best = scan_select(SCAN_AVX2);
+        auto expected = tokens(source);
+        ASSERT_EQ(200u * 13, expected.size());
+        for(int level=SCAN_SCALAR; level<=best; ++level) {
+            ASSERT_EQ(level, scan_select((scan_level_e)level));
+            ASSERT_EQ(expected, tokens(source)) << scan_name((scan_level_e)level);
+        }
+        scan_select(SCAN_AVX2);
+    }
+
+    TEST(Lexer, ParallelMatchesSequential) {
+        string source;
+        for(int i=0; i<3000; ++i) {
+            source += "/* a comment\n   over lines with \" and // in it\n */ int f" + to_string(i) + "(int a)\n{\n";
+            source += "  println(\"a string\n over two lines with /* and \\\" in it\", a / 2, " + to_string(i) + ");\n";
+            source += "  // \"unbalanced\n  return a << 2;\n}\n";
+        }
+        auto expected = lex_all(source.data(), source.data() + source.size());
+        ThreadPool pool(3);
+        auto tokens = lex_parallel(source.data(), source.data() + source.size(), pool);
+        ASSERT_EQ(expected.size(), tokens.size());
+        for(size_t i=0; i<tokens.size(); ++i) {
+            ASSERT_EQ(expected[i]->tkn, tokens[i]->tkn) << i;
+            ASSERT_STREQ(expected[i]->text, tokens[i]->text) << i;
+            if (tokens[i]->tkn == TKN_VALUE_INT) {
+                ASSERT_EQ(expected[i]->value.i, tokens[i]->value.i) << i;
+            }
+            lexfree(expected[i]);
+            lexfree(tokens[i]);
+        }
+
+        source += "int @";
+        ASSERT_THROW(lex_parallel(source.data(), source.data() + source.size(), pool), syntax_error);
+    }
+
+    static bool same(node_t *a, node_t *b) {
+        for(; a && b; a=a->next, b=b->next) {
+            if (a->tkn != b->tkn || (a->text == nullptr) != (b->text == nullptr))
+                return false;
+            if (a->text && strcmp(a->text, b->text) != 0)
+                return false;
+            if (a->tkn == TKN_VALUE_INT && a->value.i != b->value.i)
+                return false;
+            if (!same(a->down, b->down))
+                return false;
+        }
+        return a == b;
+    }
+
+    TEST(Parser, ParallelMatchesSequential) {
+        string source;
+        for(int i=0; i<500; ++i) {
+            source += "int f" + to_string(i) + "(int a, int b)\n{\n";
+            source += "  if (a < " + to_string(i) + ") {\n    return a * (b + 1);\n  }\n";
+            source += "  return f" + to_string(i) + "(a - 1, b);\n}\n";
+        }
+        const char *begin = source.data(), *end = begin + source.size();
+        auto expected = parse(begin, end);
+        ThreadPool pool(3);
+        auto root = parse_parallel(begin, end, pool);
+        ASSERT_TRUE(same(expected, root));
+        node_free(root);
+
+        // here-documents are parsed in sequence
+        string here = source + "int g(int a)\n{\n  println(a) << EOF\nnot made of @ tokens\nEOF;\n  return a;\n}\n";
+        root = parse_parallel(here.data(), here.data() + here.size(), pool);
+        ASSERT_TRUE(same(parse(here.data(), here.data() + here.size()), root));
+
+        string broken = source + "int g(int a)\n{\n  if a;\n}\n" + source;
+        ASSERT_THROW(parse_parallel(broken.data(), broken.data() + broken.size(), pool), syntax_error);
+        ASSERT_THROW(parse(broken.data(), broken.data() + broken.size()), syntax_error);
+        node_free(expected);
+    }
+
+    TEST(Document, IncrementalEdit) {
+        string source;
+        for(int i=0; i<50; ++i)
+            source += "int f" + to_string(i) + "(int a)\n{\n  return a + " + to_string(i) + ";\n}\n";
+        Document document(source);
+        ASSERT_EQ(50u, document.reparsed());
+        auto check = [&document]() {
+            const string &text = document.text();
+            node_t *expected = parse(text.data(), text.data() + text.size());
+            bool equal = same(expected, document.root());
+            node_free(expected);
+            return equal;
+        };
+        ASSERT_TRUE(check());
+
+        vector<node_t*> before;
+        for(node_t *n = document.root()->down; n; n = n->next)
+            before.push_back(n);
+        size_t at = document.text().find("a + 20");
+        document.edit(at + 4, 2, "x * 7");
+        ASSERT_EQ(1u, document.reparsed());
+        ASSERT_TRUE(check());
+        vector<node_t*> after;
+        for(node_t *n = document.root()->down; n; n = n->next)
+            after.push_back(n);
+        ASSERT_EQ(before.size(), after.size());
+        for(size_t i=0; i<after.size(); ++i) {
+            if (i != 20) {
+                ASSERT_EQ(before[i], after[i]) << i;
+            }
+        }
+
+        // adding a declaration, splitting one in two and joining them back
+        at = document.text().find("int f30");
+        document.edit(at, 0, "int g() { return 1; }\n");
+        ASSERT_EQ(2u, document.reparsed()); // g and f30
+        ASSERT_TRUE(check());
+        at = document.text().find("  return a + 10;\n}");
+        document.edit(at, 0, "  return 0;\n}\nint h(int a)\n{\n");
+        ASSERT_EQ(2u, document.reparsed());
+        ASSERT_TRUE(check());
+        document.edit(at, strlen("  return 0;\n}\nint h(int a)\n{\n"), "");
+        ASSERT_EQ(1u, document.reparsed());
+        ASSERT_TRUE(check());
+
+        // an unclosed comment hides the rest until it's closed again
+        at = document.text().find("int f40");
+        document.edit(at, 0, "/* ");
+        ASSERT_TRUE(check());
+        document.edit(document.text().size(), 0, " */");
+        ASSERT_TRUE(check());
+        document.edit(document.text().size() - 3, 3, "");
+        document.edit(at, 3, "");
+        ASSERT_TRUE(check());
+
+        // here-documents and errors
+        at = document.text().find("return a + 5;");
+        document.edit(at, 0, "println(a) << EOF\nnot made of @ tokens\nEOF;\n");
+        ASSERT_TRUE(check());
+        ASSERT_THROW(document.edit(at, 0, "if a;"), syntax_error);
+        ASSERT_EQ(nullptr, document.root());
+        document.edit(at, 5, "");
+        ASSERT_TRUE(check());
+
+        // removing the last declaration, then all of them
+        at = document.text().find("int f49");
+        document.edit(at, document.text().size() - at, "");
+        ASSERT_TRUE(check());
+        document.edit(0, document.text().size(), "");
+        ASSERT_EQ(nullptr, document.root());
+        document.edit(0, 0, "int f(int a)\n{\n  return a;\n}\n");
+        ASSERT_TRUE(check());
+        document.edit(0, document.text().size(), "");
+        ASSERT_EQ(nullptr, document.root());
+    }
+
+}